@@ -21,6 +21,9 @@
 #include "apinger.h"
 
 #include <stdio.h>
+#ifdef HAVE_STDDEF_H
+# include <stddef.h>
+#endif
 #ifdef HAVE_STDLIB_H
 # include <stdlib.h>
 #endif
@@ -42,11 +45,21 @@
 #ifdef HAVE_ARPA_INET_H
 # include <arpa/inet.h>
 #endif
+#ifdef HAVE_STDARG_H
+# include <stdarg.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+# include <pthread.h>
+#endif
 
 #include <netdb.h>
 
+#include "backend.h"
+#include "control.h"
 #include "debug.h"
+#include "metrics.h"
 #include "rrd.h"
+#include "selfstat.h"
 
 #ifdef HAVE_ASSERT_H
 # include <assert.h>
@@ -77,8 +90,8 @@ clock_gettime(int clock_id, struct timespec *tp)
 }
 #endif
 
-void
-apinger_gettime(struct timeval *tp)
+static nstime_t
+raw_gettime(void)
 {
 	struct timespec now;
 
@@ -88,250 +101,274 @@ apinger_gettime(struct timeval *tp)
 		debug("System time fetch failed");
 	}
 
-	tp->tv_usec = now.tv_nsec / 1000;
-	tp->tv_sec = now.tv_sec;
+	return ((nstime_t)now.tv_sec * NSEC_PER_SEC + now.tv_nsec);
 }
 
-#ifndef timerisset
-# define timerisset(tvp)        ((tvp)->tv_sec || (tvp)->tv_usec)
-#endif
-#ifndef timerclear
-# define timerclear(tvp)        ((tvp)->tv_sec = (tvp)->tv_usec = 0)
+static int
+raw_open(struct target *t)
+{
+	switch (t->addr.addr.sa_family) {
+	case AF_INET:
+		return (make_icmp_socket(t));
+#ifdef HAVE_IPV6
+	case AF_INET6:
+		return (make_icmp6_socket(t));
 #endif
-#ifndef timercmp
-# define timercmp(a, b, CMP)                                                  \
-  (((a)->tv_sec == (b)->tv_sec) ?                                             \
-   ((a)->tv_usec CMP (b)->tv_usec) :                                          \
-   ((a)->tv_sec CMP (b)->tv_sec))
+	default:
+		return (0);
+	}
+}
+
+static void
+raw_setup(struct target *t)
+{
+	if (t->addr.addr.sa_family == AF_INET) {
+		setup_icmp_probe(t);
+	}
+#ifdef HAVE_IPV6
+	else if (t->addr.addr.sa_family == AF_INET6) {
+		setup_icmp6_probe(t);
+	}
 #endif
-#ifndef timeradd
-# define timeradd(a, b, result)                                               \
-  do {                                                                        \
-    (result)->tv_sec = (a)->tv_sec + (b)->tv_sec;                             \
-    (result)->tv_usec = (a)->tv_usec + (b)->tv_usec;                          \
-    if ((result)->tv_usec >= 1000000)                                         \
-      {                                                                       \
-        ++(result)->tv_sec;                                                   \
-        (result)->tv_usec -= 1000000;                                         \
-      }                                                                       \
-  } while (0)
+}
+
+static void
+raw_send(struct target *t, int seq)
+{
+	if (t->addr.addr.sa_family == AF_INET) {
+		send_icmp_probe(t, seq);
+	}
+#ifdef HAVE_IPV6
+	else if (t->addr.addr.sa_family == AF_INET6) {
+		send_icmp6_probe(t, seq);
+	}
 #endif
-#ifndef timersub
-# define timersub(a, b, result)                                               \
-  do {                                                                        \
-    (result)->tv_sec = (a)->tv_sec - (b)->tv_sec;                             \
-    (result)->tv_usec = (a)->tv_usec - (b)->tv_usec;                          \
-    if ((result)->tv_usec < 0) {                                              \
-      --(result)->tv_sec;                                                     \
-      (result)->tv_usec += 1000000;                                           \
-    }                                                                         \
-  } while (0)
+}
+
+static void
+raw_recv(struct target *t, nstime_t time_recv, nstime_t timedelta)
+{
+	if (t->addr.addr.sa_family == AF_INET) {
+		recv_icmp(t, time_recv, timedelta);
+	}
+#ifdef HAVE_IPV6
+	else if (t->addr.addr.sa_family == AF_INET6) {
+		recv_icmp6(t, time_recv, timedelta);
+	}
 #endif
+}
+
+static int
+raw_poll(struct pollfd *pfd, int npfd, int timeout)
+{
+	return (poll(pfd, npfd, timeout));
+}
+
+const struct packet_backend raw_backend = {
+	.name = "raw",
+	.open = raw_open,
+	.setup = raw_setup,
+	.send = raw_send,
+	.recv = raw_recv,
+	.poll = raw_poll,
+	.gettime = raw_gettime,
+};
+
+const struct packet_backend *backend = &raw_backend;
+
+nstime_t apinger_now;
+
+/*
+ * Read the clock. The result is kept in apinger_now, which is good enough
+ * for everything but the probe and reply timestamps.
+ */
+nstime_t
+apinger_gettime(void)
+{
+	apinger_now = backend->gettime();
+	return (apinger_now);
+}
+
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
+#define PFD_EXTRA 64
 
 struct delayed_report {
 	int on;
 	struct alarm_cfg *a;
 	struct target *t;
-	struct timeval timestamp;
+	nstime_t timestamp;
 	struct delayed_report *next;
 };
 
 struct delayed_report *delayed_reports=NULL;
 
-struct timeval operation_started;
+nstime_t operation_started;
 
 
 int is_alarm_on(struct target *t,struct alarm_cfg *a){
-struct active_alarm_list *al;
 
-	for(al=t->active_alarms;al;al=al->next)
-		if (al->alarm==a)
-			return 1;
-	return 0;
+	return (t->alarms_on>>a->id)&1;
 }
 
 void alarm_on(struct target *t,struct alarm_cfg *a){
-struct active_alarm_list *al;
-struct timeval cur_time,tv;
-
-	apinger_gettime(&cur_time);
-	al=NEW(struct active_alarm_list,1);
-	al->next=t->active_alarms;
-	al->alarm=a;
-	al->num_repeats=0;
+struct alarm_state *as;
+int i;
+
+	for(i=0;i<t->config->nalarm_tab;i++)
+		if (t->config->alarm_tab[i].alarm==a)
+			break;
+	if (i==t->config->nalarm_tab){
+		logit("Alarm '%s' not configured for '%s'",a->name,t->name);
+		return;
+	}
+	as=&t->alarm_state[i];
+	as->num_repeats=0;
+	as->next_repeat=0;
 	if (a->repeat_interval){
-		tv.tv_sec=a->repeat_interval/1000;
-		tv.tv_usec=(a->repeat_interval%1000)*1000;
-		timeradd(&cur_time,&tv,&al->next_repeat);
+		as->next_repeat=apinger_now+MSEC2NS(a->repeat_interval);
 	}
-	t->active_alarms=al;
+	t->alarms_on|=(uint64_t)1<<a->id;
+	t->dirty=1;
 }
 
 void alarm_off(struct target *t,struct alarm_cfg *a){
-struct active_alarm_list *al,*pa,*na;
-
-	pa=NULL;
-	for(al=t->active_alarms;al;al=na){
-		na=al->next;
-		if (al->alarm==a){
-			if (pa!=NULL)
-				pa->next=na;
-			else
-				t->active_alarms=na;
-			free(al);
-			return;
-		}
-		else pa=al;
-	}
-	logit("Alarm '%s' not found in '%s'",a->name,t->name);
-	return;
-}
-
-static char *macros_buf=NULL;
-static int macros_buf_l=0;
-const char * subst_macros(const char *string,struct target *t,struct alarm_cfg *a,int on){
-char *p;
-int nmacros=0;
-int i,sl,l,n;
-char **values;
-char ps[16],pr[16],al[16],ad[16],ts[100];
-time_t tim;
-
-	if (string==NULL || string[0]=='\000') return "";
-	for(i=0;string[i]!='\000';i++){
-		if (string[i]!='%') continue;
-		nmacros++;
-		i++;
-		if (string[i]=='\000') break;
-	}
-	if (nmacros==0) return string;
-	values=NEW(char *,(nmacros+1));
-	assert(values!=NULL);
-	l=sl=strlen(string);
-	n=0;
-	for(i=0;i<sl;i++){
-		if (string[i]!='%') continue;
-		i++;
-		switch(string[i]){
+
+	if (!is_alarm_on(t,a)){
+		logit("Alarm '%s' not found in '%s'",a->name,t->name);
+		return;
+	}
+	t->alarms_on&=~((uint64_t)1<<a->id);
+	t->dirty=1;
+}
+
+static size_t
+catf(char *buf, size_t len, size_t n, const char *format, ...)
+{
+	va_list args;
+	int r;
+
+	va_start(args, format);
+	r = vsnprintf(n < len ? buf + n : NULL, n < len ? len - n : 0,
+	    format, args);
+	va_end(args);
+
+	return (r < 0 ? n : n + r);
+}
+
+const char *
+alarm_type_name(enum alarm_type type)
+{
+	switch (type) {
+	case AL_DOWN:
+		return ("down");
+	case AL_LOSS:
+		return ("loss");
+	case AL_DELAY:
+		return ("delay");
+	case AL_UNREACH:
+		return ("unreachable");
+	default:
+		return ("unknown");
+	}
+}
+
+/*
+ * Expand a compiled macro template into buf.  Like snprintf() the
+ * result is always terminated and the untruncated length is returned.
+ */
+size_t
+expand_macros(const struct macro_template *m, char *buf, size_t len,
+    struct target *t, struct alarm_cfg *a, int on)
+{
+	const struct macro_token *mt;
+	char ts[100];
+	struct tm tm;
+	time_t tim;
+	size_t n;
+	int i;
+
+	if (len > 0) {
+		buf[0] = '\0';
+	}
+	if (m == NULL) {
+		return (0);
+	}
+
+	for (n = 0, i = 0; i < m->ntokens; i++) {
+		mt = &m->tokens[i];
+		switch (mt->macro) {
+		case 0:
+			n = catf(buf, len, n, "%.*s", mt->len, mt->text);
+			break;
 		case 't':
-			values[n]=t->name;
+			n = catf(buf, len, n, "%s", t->name);
 			break;
 		case 'T':
-			values[n]=t->description;
+			n = catf(buf, len, n, "%s", t->description);
 			break;
 		case 'a':
-			if (a)
-				values[n]=a->name;
-			else
-				values[n]="?";
+			n = catf(buf, len, n, "%s", a ? a->name : "?");
 			break;
 		case 'A':
-			if (a)
-				switch(a->type){
-				case AL_DOWN:
-					values[n]="down";
-					break;
-				case AL_LOSS:
-					values[n]="loss";
-					break;
-				case AL_DELAY:
-					values[n]="delay";
-					break;
-				default:
-					values[n]="unknown";
-					break;
-				}
-			else
-				values[n]="?";
+			n = catf(buf, len, n, "%s",
+			    a ? alarm_type_name(a->type) : "?");
 			break;
 		case 'r':
-			switch(on){
-			case -1:
-				values[n]="alarm canceled (config reload)";
-				break;
-			case 0:
-				values[n]="alarm canceled";
-				break;
-			default:
-				values[n]="ALARM";
-				break;
-			}
+			n = catf(buf, len, n, "%s", on < 0 ?
+			    "alarm canceled (config reload)" : on == 0 ?
+			    "alarm canceled" : "ALARM");
 			break;
 		case 'p':
-			sprintf(ps,"%i",t->last_sent);
-			values[n]=ps;
+			n = catf(buf, len, n, "%i", t->last_sent);
 			break;
 		case 'P':
-			sprintf(pr,"%i",t->received);
-			values[n]=pr;
+			n = catf(buf, len, n, "%i", t->received);
+			break;
+		case 'D':
+			n = catf(buf, len, n, "%lu", t->duplicates);
+			break;
+		case 'O':
+			n = catf(buf, len, n, "%lu", t->reordered);
 			break;
 		case 'l':
-			if (AVG_LOSS_KNOWN(t)){
-				sprintf(al,"%0.1f%%",AVG_LOSS(t));
-				values[n]=al;
+			if (AVG_LOSS_KNOWN(t)) {
+				n = catf(buf, len, n, "%0.1f%%", AVG_LOSS(t));
+			} else {
+				n = catf(buf, len, n, "n/a");
 			}
-			else values[n]="n/a";
 			break;
 		case 'd':
-			if (AVG_DELAY_KNOWN(t)){
-				sprintf(ad,"%0.3fms",AVG_DELAY(t));
-				values[n]=ad;
+			if (AVG_DELAY_KNOWN(t)) {
+				n = catf(buf, len, n, "%0.3fms",
+				    target_delay(t));
+			} else {
+				n = catf(buf, len, n, "n/a");
 			}
-			else values[n]="n/a";
 			break;
 		case 's':
-			tim=time(NULL);
-			strftime(ts,100,config->timestamp_format,localtime(&tim));
-			values[n]=ts;
-			break;
-		case '%':
-			values[n]="%";
+			tim = time(NULL);
+			localtime_r(&tim, &tm);
+			strftime(ts, sizeof(ts), config->timestamp_format, &tm);
+			n = catf(buf, len, n, "%s", ts);
 			break;
 		default:
-			values[n]="";
 			break;
 		}
-		l+=strlen(values[n])+1;
-		n++;
-	}
-	values[n]=NULL;
-	l+=2;
-	if (macros_buf == NULL){
-		macros_buf=NEW(char,l);
-		macros_buf_l=l;
-	}else if (macros_buf_l != l){
-		macros_buf=(char *)realloc(macros_buf,l);
-		macros_buf_l=l;
-	}
-	assert(macros_buf!=NULL);
-	memset(macros_buf, 0, macros_buf_l);
-	p=macros_buf;
-	n=0;
-	for(i=0;i<sl;i++){
-		if (string[i]!='%'){
-			*p++=string[i];
-			continue;
-		}
-		strcpy(p,values[n]);
-		p+=strlen(values[n]);
-		n++;
-		i++;
 	}
-	free(values);
-	*p='\000';
-	return macros_buf;
+
+	return (n);
 }
 
 void
 write_report(FILE *f, struct target *t)
 {
 	fprintf(f, "%s|%s|%i|%i|%ld|", t->name, t->description,
-	    t->last_sent + 1, t->received, t->last_received_tv.tv_sec);
+	    t->last_sent + 1, t->received,
+	    (long)(t->last_received_time / NSEC_PER_SEC));
 
 	if (AVG_DELAY_KNOWN(t)) {
-		fprintf(f, "%4.3fms|", AVG_DELAY(t));
+		fprintf(f, "%4.3fms|", target_delay(t));
 	}
 
 	if (AVG_LOSS_KNOWN(t)) {
@@ -341,17 +378,34 @@ write_report(FILE *f, struct target *t)
 	fprintf(f, "\n");
 }
 
+static int
+expand_report(const struct macro_template *tmpl,
+    char *command, struct target *t, struct alarm_cfg *a, int on)
+{
+	if (expand_macros(tmpl, command, MACRO_BUF_SIZE, t, a, on) >=
+	    MACRO_BUF_SIZE) {
+		logit("Command for alarm(%s) on target(%s) is too long",
+		    a->name, t->name);
+		return (-1);
+	}
+
+	return (0);
+}
+
 void
 make_reports(struct target *t, struct alarm_cfg *a, int on)
 {
-	const char *command;
+	const struct macro_template *tmpl;
+	char command[MACRO_BUF_SIZE];
+	nstime_t start;
 	FILE *p;
 	int ret;
 
-	command = on > 0 ? a->pipe_on : a->pipe_off;
+	start = self_clock();
 
-	if (command) {
-		command = subst_macros(command, t, a, on);
+	tmpl = on > 0 ? a->pipe_on_tmpl : a->pipe_off_tmpl;
+
+	if (tmpl && expand_report(tmpl, command, t, a, on) == 0) {
 		debug("Popening: %s", command);
 		p = popen(command, "w");
 		if (!p) {
@@ -372,10 +426,9 @@ make_reports(struct target *t, struct alarm_cfg *a, int on)
 		}
 	}
 
-	command = on > 0 ? a->command_on : a->command_off;
+	tmpl = on > 0 ? a->command_on_tmpl : a->command_off_tmpl;
 
-	if (command) {
-		command = subst_macros(command, t, a, on);
+	if (tmpl && expand_report(tmpl, command, t, a, on) == 0) {
 		debug("Starting: %s", command);
 		ret = system(command);
 		if (!WIFEXITED(ret)) {
@@ -391,6 +444,8 @@ make_reports(struct target *t, struct alarm_cfg *a, int on)
 			    command, WEXITSTATUS(ret));
 		}
 	}
+
+	self_observe(SELF_REPORTS, start);
 }
 
 void make_delayed_reports(void)
@@ -409,25 +464,9 @@ void make_delayed_reports(void)
 	free(wdr);
 }
 
-void toggle_alarm(struct target *t,struct alarm_cfg *a,int on){
+static void report_alarm(struct target *t,struct alarm_cfg *a,int on){
 struct delayed_report *dr,*tdr;
 
-	if (on>0){
-		logit("ALARM: %s(%s)  *** %s ***",t->description,t->name,a->name);
-		alarm_on(t,a);
-	}
-	else{
-		alarm_off(t,a);
-		if (on==0)
-			logit("alarm canceled: %s(%s)  *** %s ***",t->description,t->name,a->name);
-		else
-			logit("alarm canceled (config reload): %s(%s)  *** %s ***",t->description,t->name,a->name);
-	}
-
-	if ((on < 0) || (t->config->force_down == 1)) {
-		return;
-	}
-
 	if (a->combine_interval>0){
 		for(tdr=delayed_reports;tdr!=NULL && tdr->next!=NULL;tdr=tdr->next){
 			if (strcmp(tdr->t->name,t->name)==0 && tdr->a==a && tdr->on==on) return;
@@ -438,7 +477,7 @@ struct delayed_report *dr,*tdr;
 		dr->t=t;
 		dr->a=a;
 		dr->on=on;
-		apinger_gettime(&dr->timestamp);
+		dr->timestamp=apinger_now;
 		dr->next=NULL;
 		if (tdr==NULL)
 			delayed_reports=dr;
@@ -450,28 +489,84 @@ struct delayed_report *dr,*tdr;
 	}
 }
 
-/* if a time came for the next event schedule next one in given interval and return 1 */
-int scheduled_event(struct timeval *next_event,struct timeval *cur_time,int interval){
-struct timeval ct,tv;
-int ret;
+/* report the alarms held back while the parent of a target was down */
+static void
+release_suppressed(struct target *t)
+{
+	struct alarm_eval *e;
+	uint64_t bits;
+	int i;
+
+	bits = t->suppressed;
+	t->suppressed = 0;
+	for (i = 0; i < t->config->nalarm_tab; i++) {
+		e = &t->config->alarm_tab[i];
+		if (bits & e->bit) {
+			logit("ALARM (parent up): %s(%s)  *** %s ***",
+			    t->description, t->name, e->alarm->name);
+			report_alarm(t, e->alarm, 1);
+		}
+	}
+}
+
+static void
+release_children(struct target *t)
+{
+	struct target *c;
+
+	for (c = t->children; c; c = c->sibling) {
+		if (c->suppressed && !PARENT_DOWN(c)) {
+			release_suppressed(c);
+		}
+	}
+}
+
+void toggle_alarm(struct target *t,struct alarm_cfg *a,int on){
+uint64_t bit=(uint64_t)1<<a->id;
 
-	if (cur_time==NULL){
-		apinger_gettime(&ct);
-		cur_time=&ct;
+	if (on>0){
+		logit("ALARM: %s(%s)  *** %s ***",t->description,t->name,a->name);
+		alarm_on(t,a);
 	}
-	if (!timerisset(next_event) || timercmp(next_event,cur_time,<)){
-		if (!timerisset(next_event)){
-			*next_event=*cur_time;
+	else{
+		alarm_off(t,a);
+		if (on==0)
+			logit("alarm canceled: %s(%s)  *** %s ***",t->description,t->name,a->name);
+		else
+			logit("alarm canceled (config reload): %s(%s)  *** %s ***",t->description,t->name,a->name);
+		if (t->children) release_children(t);
+		if (t->suppressed&bit){
+			/* it was never reported */
+			t->suppressed&=~bit;
+			return;
 		}
-		tv.tv_sec=interval/1000;
-		tv.tv_usec=(interval%1000)*1000;
-		timeradd(cur_time,&tv,next_event);
+	}
+
+	if ((on < 0) || (t->config->force_down == 1)) {
+		return;
+	}
+
+	if (on>0 && PARENT_DOWN(t)){
+		logit("Alarm %s of %s(%s) suppressed, %s is down",a->name,t->description,t->name,t->parent->name);
+		t->suppressed|=bit;
+		return;
+	}
+
+	report_alarm(t,a,on);
+}
+
+/* if a time came for the next event schedule next one in given interval and return 1 */
+int scheduled_event(nstime_t *next_event,nstime_t cur_time,int interval){
+int ret;
+
+	if (*next_event==0 || *next_event<cur_time){
+		*next_event=cur_time+MSEC2NS(interval);
 		ret=1;
 	}
 	else {
 		ret=0;
 	}
-	if (!timerisset(&next_probe) || timercmp(next_event,&next_probe,<))
+	if (next_probe==0 || *next_event<next_probe)
 		next_probe=*next_event;
 	return ret;
 }
@@ -484,19 +579,8 @@ send_probe(struct target *t)
 	seq = ++t->last_sent;
 	debug("Sending ping #%i to %s (%s)",seq,t->description,t->name);
 
-#if 0
-	{
-		char buf[100];
-
-		strftime(buf,100,"%b %d %H:%M:%S",localtime(&t->next_probe.tv_sec));
-		debug("Next one scheduled for %s",buf);
-	}
-#endif
 
-	if (t->addr.addr.sa_family==AF_INET) send_icmp_probe(t,seq);
-#ifdef HAVE_IPV6
-	else if (t->addr.addr.sa_family==AF_INET6) send_icmp6_probe(t,seq);
-#endif
+	backend->send(t, seq);
 
 	i=t->last_sent%(t->config->avg_loss_delay_samples+t->config->avg_loss_samples);
 	if (t->last_sent>t->config->avg_loss_delay_samples+t->config->avg_loss_samples){
@@ -515,354 +599,1098 @@ send_probe(struct target *t)
 		t->recently_lost = 0;
 
 	t->upsent++;
+	t->dirty = 1;
 }
 
+/* derive loss, dispersion and reordering of the last probe train */
+static void
+finish_train(struct target *t)
+{
+	int received;
 
-void analyze_reply(struct timeval *time_recv,int icmp_seq,struct trace_info *ti, int timedelta){
-struct target *t;
-struct timeval tv;
-double delay,avg_delay,avg_loss;
-double tmp;
-int i;
-int previous_received;
-struct alarm_list *al;
-struct active_alarm_list *aal,*paa,*naa;
-struct alarm_cfg *a;
-
-	if (icmp_seq!=(ti->seq%65536)){
-		debug("Sequence number mismatch.");
+	if (t->train_size == 0) {
 		return;
 	}
 
-	for(t=targets;t!=NULL;t=t->next){
-		if (t==ti->target_id) break;
+	received = MIN(t->train_received, t->train_size);
+	t->train_loss = (double)(t->train_size - received) / t->train_size;
+	if (received > 1) {
+		t->train_dispersion =
+		    NS2MSEC(t->train_last_time - t->train_first_time);
+	} else {
+		t->train_dispersion = 0;
 	}
-	if (t==NULL){
-		logit("Couldn't match any target to the echo reply.\n");
-		return;
+	t->train_reorder = t->train_reordered;
+	t->trains++;
+	t->train_size = 0;
+	t->dirty = 1;
+
+	debug("Train to %s(%s): loss %.1f%%, dispersion %.3fms, "
+	    "%i reordered", t->description, t->name, 100 * t->train_loss,
+	    t->train_dispersion, t->train_reorder);
+}
+
+static void
+train_reply(struct target *t, int seq, nstime_t time_recv)
+{
+	if (t->train_received++ == 0) {
+		t->train_first_time = time_recv;
+	} else if (seq < t->train_highest) {
+		t->train_reordered++;
 	}
-	previous_received=t->last_received;
-	if (ti->seq>t->last_received) t->last_received=ti->seq;
-	t->last_received_tv=*time_recv;
-	timersub(time_recv,&ti->timestamp,&tv);
-	delay=tv.tv_sec*1000.0+((double)tv.tv_usec)/1000.0 - timedelta;
-	//if (delay < 0) delay = 0;
-	tmp=t->rbuf[t->received%t->config->avg_delay_samples];
-	t->rbuf[t->received%t->config->avg_delay_samples]=delay;
-	t->delay_sum+=delay-tmp;
-	debug("#%i from %s(%s) delay: %4.3fms/%4.3fms/%4.3fms received = %d ",ti->seq,t->description,t->name,delay,tmp,t->delay_sum, t->received);
-	if (t->delay_sum < 0) t->delay_sum = 0;
-	t->received++;
+	if (seq > t->train_highest) {
+		t->train_highest = seq;
+	}
+	t->train_last_time = time_recv;
+}
 
-	avg_delay=AVG_DELAY(t);
-	debug("(avg: %4.3fms)",avg_delay);
+/* send the probe, or the whole train of probes, for one interval */
+static void
+send_train(struct target *t)
+{
+	int i;
 
-	i=ti->seq%(t->config->avg_loss_delay_samples+t->config->avg_loss_samples);
-#if 0
-	if (!t->queue[i] && ti->seq<=t->last_sent-t->config->avg_loss_delay_samples)
-		t->recently_lost--;
-#endif
-	t->queue[i]=1;
+	finish_train(t);
 
-	if (AVG_LOSS_KNOWN(t)){
-		avg_loss=AVG_LOSS(t);
-	}else
-		avg_loss=0;
+	if (t->config->train <= 1) {
+		send_probe(t);
+		return;
+	}
 
-	debug("(avg. loss: %5.1f%%)",avg_loss);
+	t->train_first = t->last_sent + 1;
+	t->train_size = t->config->train;
+	t->train_received = 0;
+	t->train_reordered = 0;
+	t->train_highest = 0;
 
-	paa=NULL;
-	for(aal=t->active_alarms;aal;aal=naa){
-		naa=aal->next;
-		a=aal->alarm;
-		if (a->type==AL_DOWN){
-			t->received = 1;
-			t->recently_lost = 0;
-			t->upsent=0;
-			avg_loss=0;
-		}
-		if ((a->type==AL_DOWN)
-		   || (a->type==AL_DELAY && avg_delay<a->p.lh.low)
-		   || (a->type==AL_LOSS && avg_loss<a->p.lh.low) ){
-			if (a->type == AL_DELAY) {
-				t->delay_sum = delay-tmp;
-				if (t->delay_sum < 0)
-					t->delay_sum = 0;
-			}
-			toggle_alarm(t,a,0);
-		}
+	for (i = 0; i < t->train_size; i++) {
+		send_probe(t);
 	}
+}
 
-	for(al=t->config->alarms;al;al=al->next){
-		a=al->alarm;
-		if (is_alarm_on(t,a)) continue;
-		switch(a->type){
-		case AL_DELAY:
-			if (AVG_DELAY_KNOWN(t) && avg_delay>a->p.lh.high )
-				toggle_alarm(t,a,1);
-			break;
-		case AL_LOSS:
-			if ( avg_loss > a->p.lh.high )
-				toggle_alarm(t,a,1);
-			break;
-		default:
-			break;
+
+/*
+ * Probe slots: a reply names its target by slot and generation, so it is
+ * found in O(1), and a reply to a deleted target (whose slot may have
+ * been reused since) is recognized as stale.
+ */
+static struct target **probe_slots = NULL;
+static uint32_t *probe_slot_gen = NULL;
+static uint32_t *probe_free = NULL;	/* stack of released slots */
+static uint32_t probe_nfree = 0;
+static uint32_t probe_slots_used = 0;
+static uint32_t probe_slots_size = 0;
+static uint32_t probe_secret = 0;
+
+static void
+probe_slot_alloc(struct target *t)
+{
+	uint32_t i, size;
+
+	if (probe_nfree) {
+		i = probe_free[--probe_nfree];
+	} else {
+		if (probe_slots_used == probe_slots_size) {
+			size = probe_slots_size ? probe_slots_size * 2 : 64;
+			probe_slots = realloc(probe_slots,
+			    sizeof(*probe_slots) * size);
+			probe_slot_gen = realloc(probe_slot_gen,
+			    sizeof(*probe_slot_gen) * size);
+			probe_free = realloc(probe_free,
+			    sizeof(*probe_free) * size);
+			assert(probe_slots != NULL && probe_slot_gen != NULL &&
+			    probe_free != NULL);
+			memset(probe_slot_gen + probe_slots_size, 0,
+			    sizeof(*probe_slot_gen) *
+			    (size - probe_slots_size));
+			probe_slots_size = size;
 		}
+		i = probe_slots_used++;
+	}
+
+	if (probe_secret == 0) {
+		probe_secret = random() | 1;
 	}
+
+	probe_slots[i] = t;
+	t->slot = i;
+	t->slot_gen = ++probe_slot_gen[i];
 }
 
-int
-configure_targets(struct config *cfg)
+static void
+probe_slot_free(struct target *t)
 {
-	struct delayed_report *dr, *pdr, *ndr;
-	struct active_alarm_list *aal, *naal;
-#ifdef HAVE_IPV6
-	struct addrinfo hints, *res;
-#endif
-	struct target *t, *pt, *nt;
-	struct alarm_cfg *a, *na;
-	union addr addr, srcaddr;
-	struct target_cfg *tc;
-	int r, l;
+	if (t->slot < probe_slots_used && probe_slots[t->slot] == t) {
+		probe_slots[t->slot] = NULL;
+		probe_free[probe_nfree++] = t->slot;
+	}
+}
 
-	/* delete all unconfigured targets */
-	pt = NULL;
+static uint32_t
+probe_cksum(const struct trace_info *ti)
+{
+	const unsigned char *p = (const unsigned char *)ti;
+	uint32_t h = HASH_INIT ^ probe_secret;
+	size_t i;
 
-	for (t = targets; t; t = nt) {
-		for (tc = cfg->targets; tc; tc = tc->next) {
-			if (strlen(tc->srcip) != strlen(t->config->srcip) ||
-			    strcmp(tc->srcip, t->config->srcip)) {
-				continue;
-			}
-			if (strlen(tc->name) == strlen(t->name) &&
-			    !strcmp(tc->name, t->name)) {
-				break;
-			}
-		}
+	for (i = 0; i < offsetof(struct trace_info, cksum); i++) {
+		h ^= p[i];
+		h *= 16777619U;
+	}
 
-		nt = t->next;
+	return (h);
+}
 
-		if (!tc) {
-			if (!pt) {
-				targets = nt;
-			} else {
-				pt->next = nt;
-			}
-			for (aal = t->active_alarms; aal; aal = naal) {
-				naal = aal->next;
-				toggle_alarm(t, aal->alarm, -1);
-			}
-			if (t->socket) {
-				close(t->socket);
-			}
+void
+make_trace_info(struct trace_info *ti, struct target *t, int seq)
+{
+	memset(ti, 0, sizeof(*ti));
+	ti->timestamp = apinger_gettime();
+	ti->slot = t->slot;
+	ti->gen = t->slot_gen;
+	ti->seq = seq;
+	ti->cksum = probe_cksum(ti);
+}
 
-			if (delayed_reports) {
-				pdr = NULL;
-				for (dr = delayed_reports; dr; dr = ndr) {
-					ndr = dr->next;
-					if (dr->t == t) {
-						if (!pdr) {
-							delayed_reports = ndr;
-						} else {
-							pdr->next = ndr;
-						}
-						free(dr);
-					} else {
-						pdr = dr;
-					}
-				}
-			}
+/*
+ * Sliding window of answered sequence numbers below last_received.
+ * Returns 0 for a duplicate, which must not be accounted again.
+ */
+static int
+track_reply(struct target *t, int seq)
+{
+	unsigned int d;
 
-			debug("Releasing target %s(%s)", t->name,
-			    t->description);
+	if (seq > t->last_received) {
+		d = seq - t->last_received;
+		t->rx_window = d < 64 ? (t->rx_window << d) | 1 : 1;
+		t->last_received = seq;
+		return (1);
+	}
 
-			free(t->description);
-			free(t->queue);
-			free(t->rbuf);
-			free(t->name);
-			free(t);
-		} else {
-			pt = t;
-
-			for (aal = t->active_alarms; aal; aal = naal) {
-				naal = aal->next;
-				for (a = cfg->alarms; a; a = na) {
-					na = a->next;
-					if (aal->alarm->type == a->type &&
-					    !strcmp(aal->alarm->name,
-					    a->name)) {
-						debug("Sticking to alrm %s "
-						    "since its still active",
-						    a->name);
-						aal->alarm = a;
-						break;
-					}
-				}
-			}
+	d = t->last_received - seq;
+	if (d < 64 && (t->rx_window & ((uint64_t)1 << d))) {
+		t->duplicates++;
+		t->dirty = 1;
+		debug("Duplicate reply #%i from %s", seq, t->name);
+		return (0);
+	}
+	if (d < 64) {
+		t->rx_window |= (uint64_t)1 << d;
+	}
 
-			if (delayed_reports) {
-				for (dr = delayed_reports; dr; dr = dr->next) {
-					if (dr->t == t) {
-						for (a = cfg->alarms; a; a = a->next) {
-							if (dr->a->type == a->type &&
-							    !strcmp(dr->a->name, a->name)) {
-								debug("Updating delayed report for target(%s) and alarm(%s)", t->name, a->name);
-								dr->a = a;
-							}
-						}
-					}
-				}
+	t->reordered++;
+	t->dirty = 1;
+	debug("Reordered reply #%i from %s, last #%i", seq, t->name,
+	    t->last_received);
+
+	return (1);
+}
+
+/*
+ * An ICMP error quoting one of our outstanding probes: count it and
+ * raise the "unreachable" alarms of the target right away.  They are
+ * canceled by the next echo reply.
+ */
+void
+analyze_error(struct target *t, int icmp_seq, enum icmp_error err)
+{
+	struct alarm_eval *e;
+	int seq, window, i;
+
+	window = t->config->avg_loss_delay_samples +
+	    t->config->avg_loss_samples;
+	seq = t->last_sent - ((t->last_sent - icmp_seq) & 0xffff);
+	if (t->last_sent - seq >= window) {
+		debug("Stale ICMP error for %s", t->name);
+		return;
+	}
+
+	if (err == ICMP_ERR_UNREACH) {
+		t->unreachable++;
+	} else {
+		t->time_exceeded++;
+	}
+	t->dirty = 1;
+
+	debug("Probe #%i to %s(%s) failed: %s", seq, t->description, t->name,
+	    err == ICMP_ERR_UNREACH ? "unreachable" : "time exceeded");
+
+	for (i = 0; i < t->config->nalarm_tab; i++) {
+		e = &t->config->alarm_tab[i];
+		if (e->type == AL_UNREACH && !(t->alarms_on & e->bit)) {
+			toggle_alarm(t, e->alarm, 1);
+		}
+	}
+}
+
+/* validate a probe record and return the target it belongs to */
+static struct target *
+probe_target(const struct trace_info *ti)
+{
+	struct target *t;
+	int window;
+
+	if (ti->cksum != probe_cksum(ti)) {
+		debug("Bad probe record checksum");
+		return (NULL);
+	}
+	if (ti->slot >= probe_slots_used || probe_slots[ti->slot] == NULL ||
+	    probe_slot_gen[ti->slot] != ti->gen) {
+		debug("Reply to a target which is gone");
+		return (NULL);
+	}
+
+	t = probe_slots[ti->slot];
+
+	/* only probes still in the loss window can be accounted */
+	window = t->config->avg_loss_delay_samples +
+	    t->config->avg_loss_samples;
+	if ((unsigned int)(t->last_sent - ti->seq) >= (unsigned int)window) {
+		debug("Stale reply #%i from %s, last sent #%i", ti->seq,
+		    t->name, t->last_sent);
+		return (NULL);
+	}
+
+	return (t);
+}
+
+/* our own latency, measured against the calibration target, in ms */
+static double calib_delay = 0;
+static int calib_known = 0;
+
+/* the median of the recent calibration replies becomes the baseline */
+static void
+calibrate(struct target *t)
+{
+	double samples[CALIBRATE_SAMPLES_MAX], d;
+	int i, j, n;
+
+	n = t->received < t->config->avg_delay_samples ?
+	    t->received : t->config->avg_delay_samples;
+	if (n > CALIBRATE_SAMPLES_MAX) {
+		n = CALIBRATE_SAMPLES_MAX;
+	}
+	for (i = 0; i < n; i++) {
+		d = t->rbuf[i] / 1000.0;
+		for (j = i; j > 0 && samples[j - 1] > d; j--) {
+			samples[j] = samples[j - 1];
+		}
+		samples[j] = d;
+	}
+	if (n == 0) {
+		return;
+	}
+
+	calib_delay = n % 2 ? samples[n / 2] :
+	    (samples[n / 2 - 1] + samples[n / 2]) / 2;
+	calib_known = 1;
+}
+
+static double
+correct_delay(struct target *t, double delay)
+{
+	if (!config->calibrate || !calib_known || t->config->calibration) {
+		return (delay);
+	}
+
+	delay -= calib_delay;
+
+	return (delay > 0 ? delay : 0);
+}
+
+/* number of bits set in x */
+static int
+popcount(uint64_t x)
+{
+#ifdef __GNUC__
+	return (__builtin_popcountll(x));
+#else
+	int n;
+
+	for (n = 0; x; n++) {
+		x &= x - 1;
+	}
+	return (n);
+#endif
+}
+
+/* recent average delay, less our own latency when calibrating */
+double
+target_delay(struct target *t)
+{
+	return (correct_delay(t, AVG_DELAY(t)));
+}
+
+void analyze_reply(nstime_t time_recv,int icmp_seq,struct trace_info *ti, nstime_t timedelta){
+struct target *t;
+nstime_t rtt;
+double delay,avg_delay,avg_loss;
+uint32_t sample,old;
+int i;
+int previous_received;
+struct target_cfg *tc;
+struct alarm_eval *e;
+struct alarm_state *as;
+struct trace_info rec;
+int high,low;
+
+	/* the payload need not be aligned */
+	memcpy(&rec, ti, sizeof(rec));
+	ti = &rec;
+
+	if (icmp_seq!=(ti->seq&0xffff)){
+		debug("Sequence number mismatch.");
+		return;
+	}
+
+	t = probe_target(ti);
+	if (t == NULL) {
+		return;
+	}
+	previous_received=t->last_received;
+	if (!track_reply(t, ti->seq)) {
+		return;
+	}
+	t->last_received_time=time_recv;
+	rtt=time_recv-ti->timestamp;
+	/* without calibration guess how long the reply waited for us */
+	if (!config->calibrate) rtt-=timedelta;
+	delay=NS2MSEC(rtt);
+	/* kept in whole microseconds, so the sum never drifts */
+	if (rtt<=0) sample=0;
+	else if (rtt/1000>0xffffffffLL) sample=0xffffffffU;
+	else sample=rtt/1000;
+	i=t->received%t->config->avg_delay_samples;
+	old=t->rbuf[i];
+	t->rbuf[i]=sample;
+	t->delay_sum-=old;
+	t->delay_sum+=sample;
+	debug("#%i from %s(%s) delay: %4.3fms/%4.3fms/%4.3fms received = %d ",ti->seq,t->description,t->name,delay,old/1000.0,t->delay_sum/1000.0, t->received);
+	t->received++;
+	if (t->config->calibration) calibrate(t);
+	metrics_observe(t,correct_delay(t,delay));
+
+	if (t->train_size && ti->seq >= t->train_first &&
+	    ti->seq < t->train_first + t->train_size) {
+		train_reply(t, ti->seq, time_recv);
+	}
+
+	avg_delay=target_delay(t);
+	debug("(avg: %4.3fms)",avg_delay);
+
+	i=ti->seq%(t->config->avg_loss_delay_samples+t->config->avg_loss_samples);
+#if 0
+	if (!t->queue[i] && ti->seq<=t->last_sent-t->config->avg_loss_delay_samples)
+		t->recently_lost--;
+#endif
+	t->queue[i]=1;
+
+	if (AVG_LOSS_KNOWN(t)){
+		avg_loss=AVG_LOSS(t);
+	}else
+		avg_loss=0;
+
+	debug("(avg. loss: %5.1f%%)",avg_loss);
+
+	tc=t->config;
+	if (t->alarms_on&tc->down_mask){
+		/* back up, the averages start over with this reply */
+		memset(t->rbuf,0,sizeof(*t->rbuf)*tc->avg_delay_samples);
+		t->rbuf[0]=sample;
+		t->delay_sum=sample;
+		t->received = 1;
+		t->recently_lost = 0;
+		t->upsent=0;
+		avg_loss=0;
+	}
+
+	for(i=0;i<tc->nalarm_tab;i++){
+		e=&tc->alarm_tab[i];
+		as=&t->alarm_state[i];
+		switch(e->type){
+		case AL_DELAY:
+			high=AVG_DELAY_KNOWN(t) && avg_delay>e->high;
+			low=avg_delay<e->low;
+			break;
+		case AL_LOSS:
+			high=avg_loss>e->high;
+			low=avg_loss<e->low;
+			break;
+		default:
+			/* down and unreachable end with any reply */
+			if (t->alarms_on&e->bit) toggle_alarm(t,e->alarm,0);
+			continue;
+		}
+		/* "need" of the last "window" replies decide, see popcount() */
+		as->above=((as->above<<1)|high)&e->window_mask;
+		as->below=((as->below<<1)|low)&e->window_mask;
+		if (as->changed && time_recv-as->changed<MSEC2NS(e->hold))
+			continue;
+		if (t->alarms_on&e->bit){
+			if (popcount(as->below)<e->need) continue;
+			toggle_alarm(t,e->alarm,0);
+		}
+		else {
+			if (popcount(as->above)<e->need) continue;
+			toggle_alarm(t,e->alarm,1);
+		}
+		as->changed=time_recv;
+	}
+	/* no down alarm is active now, the shortest one is next */
+	t->down_deadline=tc->down_time?time_recv+MSEC2NS(tc->down_time):0;
+}
+
+static struct target **target_hash = NULL;
+static unsigned int target_hash_size = 0;
+static unsigned int target_count = 0;
+
+static unsigned int
+target_key(const char *name, const char *srcip)
+{
+	return (hash_string(hash_string(HASH_INIT, srcip), name));
+}
+
+static void
+target_hash_insert(struct target *t)
+{
+	struct target **nh, *ht, *nt;
+	unsigned int i, b, size;
+
+	if (target_count >= target_hash_size / 2) {
+		size = target_hash_size ? target_hash_size * 2 : 256;
+		nh = NEW(struct target *, size);
+		assert(nh != NULL);
+		for (i = 0; i < target_hash_size; i++) {
+			for (ht = target_hash[i]; ht; ht = nt) {
+				nt = ht->hnext;
+				b = ht->hkey & (size - 1);
+				ht->hnext = nh[b];
+				nh[b] = ht;
 			}
 		}
+		free(target_hash);
+		target_hash = nh;
+		target_hash_size = size;
 	}
 
-	/* Update target configuration */
-	for (tc = cfg->targets; tc; tc = tc->next) {
-		for (t = targets; t; t = t->next) {
-			if (strlen(tc->srcip) != strlen(t->config->srcip) ||
-			    strcmp(tc->srcip, t->config->srcip)) {
-				continue;
+	t->hkey = target_key(t->name, t->srcip);
+	b = t->hkey & (target_hash_size - 1);
+	t->hnext = target_hash[b];
+	target_hash[b] = t;
+	target_count++;
+}
+
+static void
+target_hash_remove(struct target *t)
+{
+	struct target **tp;
+
+	if (target_hash == NULL) {
+		return;
+	}
+
+	for (tp = &target_hash[t->hkey & (target_hash_size - 1)]; *tp;
+	    tp = &(*tp)->hnext) {
+		if (*tp == t) {
+			*tp = t->hnext;
+			target_count--;
+			return;
+		}
+	}
+}
+
+/*
+ * Make the target named by depends_on the parent of t, unless that
+ * would close a loop. Children are reached from their parent in O(1).
+ */
+void
+link_target(struct target *t)
+{
+	const char *dep = t->config->depends_on;
+	struct target *p, *q;
+
+	if (dep == NULL) {
+		return;
+	}
+	p = find_target(dep, t->srcip);
+	if (p == NULL) {
+		p = find_target(dep, dep);
+	}
+	if (p == NULL) {
+		logit("Target %s depends on %s, which is not monitored",
+		    t->name, dep);
+		return;
+	}
+	if (p == t) {
+		/* the parent itself, "depends_on" given in target default */
+		return;
+	}
+	for (q = p; q; q = q->parent) {
+		if (q == t) {
+			logit("Ignoring dependency of %s on %s, it would "
+			    "form a loop", t->name, dep);
+			return;
+		}
+	}
+	t->parent = p;
+	t->sibling = p->children;
+	p->children = t;
+}
+
+static void
+unlink_target(struct target *t)
+{
+	struct target **pp, *c;
+
+	if (t->parent) {
+		for (pp = &t->parent->children; *pp != t; pp = &(*pp)->sibling)
+			/* empty */;
+		*pp = t->sibling;
+	}
+	for (c = t->children; c; c = c->sibling) {
+		c->parent = NULL;
+		if (c->suppressed) {
+			release_suppressed(c);
+		}
+	}
+	t->parent = t->children = t->sibling = NULL;
+}
+
+static void
+release_target(struct target *t)
+{
+	struct delayed_report *dr, *pdr, *ndr;
+	int i;
+
+	for (i = 0; i < t->config->nalarm_tab; i++) {
+		if (t->alarms_on & t->config->alarm_tab[i].bit) {
+			toggle_alarm(t, t->config->alarm_tab[i].alarm, -1);
+		}
+	}
+	unlink_target(t);
+	if (t->socket) {
+		close(t->socket);
+	}
+
+	if (delayed_reports) {
+		pdr = NULL;
+		for (dr = delayed_reports; dr; dr = ndr) {
+			ndr = dr->next;
+			if (dr->t == t) {
+				if (!pdr) {
+					delayed_reports = ndr;
+				} else {
+					pdr->next = ndr;
+				}
+				free(dr);
+			} else {
+				pdr = dr;
 			}
-			if (strlen(t->name) == strlen(tc->name) &&
-			    !strcmp(t->name, tc->name)) {
+		}
+	}
+
+	debug("Releasing target %s(%s)", t->name, t->description);
+
+	target_hash_remove(t);
+	probe_slot_free(t);
+	metrics_forget(t);
+	free(t->queue);
+	free(t->rbuf);
+	free(t->alarm_state);
+	free(t->probe);
+	free(t);
+}
+
+/*
+ * Raise the down alarms due before "now" and arm the deadline of the
+ * next one, so the main loop need not look at the alarms until then.
+ */
+static void
+check_down(struct target *t, nstime_t now)
+{
+	struct alarm_eval *e;
+	nstime_t base, due;
+	int i;
+
+	/* a parent going down at the same time must suppress our alarms */
+	if (t->parent && t->parent->down_deadline &&
+	    t->parent->down_deadline < now) {
+		check_down(t->parent, now);
+	}
+
+	base = t->last_received_time ? t->last_received_time : t->started;
+	t->down_deadline = 0;
+	for (i = 0; i < t->config->nalarm_tab; i++) {
+		e = &t->config->alarm_tab[i];
+		if (e->type != AL_DOWN || (t->alarms_on & e->bit)) {
+			continue;
+		}
+		due = base + MSEC2NS(e->alarm->p.val);
+		if (due < now) {
+			toggle_alarm(t, e->alarm, 1);
+		} else if (t->down_deadline == 0 || due < t->down_deadline) {
+			t->down_deadline = due;
+		}
+	}
+}
+
+/*
+ * Carry the active alarms of a target over to its new configuration,
+ * cancelling those it no longer has.
+ */
+static void
+remap_alarms(struct target *t, struct target_cfg *tc,
+    struct alarm_state *state)
+{
+	struct target_cfg *otc = t->config;
+	struct alarm_eval *e, *ne;
+	uint64_t on, sup;
+	int i, j;
+
+	on = sup = 0;
+	for (i = 0; i < otc->nalarm_tab; i++) {
+		e = &otc->alarm_tab[i];
+		if (!(t->alarms_on & e->bit)) {
+			continue;
+		}
+		for (j = 0; j < tc->nalarm_tab; j++) {
+			ne = &tc->alarm_tab[j];
+			if (ne->type == e->type &&
+			    strcmp(ne->alarm->name, e->alarm->name) == 0) {
 				break;
 			}
 		}
+		if (j == tc->nalarm_tab) {
+			toggle_alarm(t, e->alarm, -1);
+			continue;
+		}
+		debug("Sticking to alrm %s since its still active",
+		    e->alarm->name);
+		state[j] = t->alarm_state[i];
+		on |= tc->alarm_tab[j].bit;
+		if (t->suppressed & e->bit) {
+			sup |= tc->alarm_tab[j].bit;
+		}
+	}
+	t->alarms_on = on;
+	t->suppressed = sup;
+}
+
+static void
+configure_target(struct target *t, struct target_cfg *tc)
+{
+	struct alarm_state *state;
+	int l;
+
+	l=tc->avg_loss_delay_samples+tc->avg_loss_samples;
+	if (t->queue) {
+		if (l > (t->config->avg_loss_delay_samples+t->config->avg_loss_samples)) {
+			t->queue = realloc(t->queue, l);
+			assert(t->queue != NULL);
+			memset(t->queue+(t->config->avg_loss_delay_samples+t->config->avg_loss_samples), 0, l - (t->config->avg_loss_delay_samples+t->config->avg_loss_samples));
+		} else if (l < (t->config->avg_loss_delay_samples+t->config->avg_loss_samples)) {
+			t->queue = realloc(t->queue, l);
+			assert(t->queue != NULL);
+		}
+	} else {
+		t->queue=NEW(char,l);
+		assert(t->queue!=NULL);
+	}
 
-		if (t == NULL) {
-			/* new target */
-			memset(&addr, 0, sizeof(addr));
-			r = inet_pton(AF_INET, tc->name, &addr.addr4.sin_addr);
-			if (r) {
-				addr.addr.sa_family = AF_INET;
-			} else {
+	/* t->recently_lost=tc->avg_loss_samples; */
+	l=tc->avg_delay_samples;
+	if (t->rbuf) {
+		if (l > t->config->avg_delay_samples) {
+			t->rbuf= realloc(t->rbuf, sizeof(*t->rbuf) * l);
+			assert(t->rbuf!= NULL);
+			memset(t->rbuf+t->config->avg_delay_samples, 0, sizeof(*t->rbuf) * (l - t->config->avg_delay_samples));
+		} else if (l < t->config->avg_delay_samples) {
+			int tmp;
+			for (tmp = l; tmp < t->config->avg_delay_samples;tmp++)
+				t->delay_sum -= t->rbuf[tmp];
+			t->rbuf= realloc(t->rbuf, sizeof(*t->rbuf) * l);
+			assert(t->rbuf!= NULL);
+		}
+	} else {
+		t->rbuf = NEW(uint32_t, l);
+		assert(t->rbuf != NULL);
+	}
+
+	/* adaptive probing must not outwait the shortest down alarm */
+	t->max_interval = 0;
+	if (tc->max_interval > tc->interval) {
+		t->max_interval = tc->max_interval;
+		if (tc->down_time && tc->down_time / 2 < t->max_interval) {
+			t->max_interval = tc->down_time / 2;
+		}
+		if (t->max_interval <= tc->interval) {
+			t->max_interval = 0;
+		}
+	}
+	t->fast_interval = tc->interval;
+	if (tc->fast_interval > 0 && tc->fast_interval < tc->interval) {
+		t->fast_interval = tc->fast_interval;
+	}
+	/* a reload keeps the back-off reached, within the new bounds */
+	if (!t->max_interval || !t->cur_interval) {
+		t->cur_interval = tc->interval;
+	} else if (t->cur_interval < t->fast_interval) {
+		t->cur_interval = t->fast_interval;
+	} else if (t->cur_interval > t->max_interval) {
+		t->cur_interval = t->max_interval;
+	}
+
+	/* alarm state is allocated here only, never on the reply path */
+	state = NEW(struct alarm_state, tc->nalarm_tab + 1);
+	assert(state != NULL);
+	if (t->alarm_state) {
+		remap_alarms(t, tc, state);
+		free(t->alarm_state);
+	}
+	t->alarm_state = state;
+
+	t->description = tc->description;
+	t->config = tc;
+	/* the old configuration, holding the string, is about to go */
+	t->srcip = TARGET_SRCIP(tc, t->name);
+
+	if (backend->setup) {
+		backend->setup(t);
+	}
+}
+
+/*
+ * Start a new target at a fixed phase within its interval, derived from
+ * its name, so targets do not all fire in the same pass of the loop.
+ */
+static void
+spread_probe(struct target *t, nstime_t cur_time)
+{
+	t->next_probe = cur_time + MSEC2NS(t->hkey % t->cur_interval);
+
+	if (next_probe == 0 || t->next_probe < next_probe) {
+		next_probe = t->next_probe;
+	}
+}
+
+static void
+jitter_probe(struct target *t)
+{
+	if (t->config->jitter <= 0) {
+		return;
+	}
+
+	t->next_probe += MSEC2NS(random() % t->config->jitter);
+}
+
+/*
+ * Global token bucket for "max_pps", holding at most a tenth of a second
+ * worth of probes.  When it is empty the loop is woken up again as soon
+ * as the next token is due.
+ */
+static int
+pace_probe(nstime_t cur_time, int n)
+{
+	static nstime_t pace_time;
+	static double pace_tokens;
+	nstime_t when;
+	double burst;
+
+	if (config->max_pps <= 0) {
+		return (1);
+	}
+
+	burst = config->max_pps / 10.0;
+	if (burst < 1) {
+		burst = 1;
+	}
+
+	if (pace_time != 0) {
+		pace_tokens += (double)(cur_time - pace_time) / NSEC_PER_SEC *
+		    config->max_pps;
+	} else {
+		pace_tokens = burst;
+	}
+	pace_time = cur_time;
+	if (pace_tokens > burst) {
+		pace_tokens = burst;
+	}
+
+	/* a train may leave the bucket in debt */
+	if (pace_tokens >= 1) {
+		pace_tokens -= n;
+		return (1);
+	}
+
+	when = cur_time + (nstime_t)((1 - pace_tokens) * NSEC_PER_SEC /
+	    config->max_pps) + 1;
+	if (next_probe == 0 || when < next_probe) {
+		next_probe = when;
+	}
+
+	return (0);
+}
+
+/*
+ * Pick the interval to the next probe of an adaptive target: back off
+ * while it is healthy and go fast once anything looks wrong.
+ */
+static void
+adapt_interval(struct target *t)
+{
+	struct alarm_eval *e;
+	int unhealthy, l, i;
+
+	if (!t->max_interval) {
+		t->cur_interval = t->config->interval;
+		return;
+	}
+
+	/* alarms, recent loss or an unanswered previous probe */
+	l = t->config->avg_loss_delay_samples + t->config->avg_loss_samples;
+	unhealthy = t->alarms_on != 0 || t->recently_lost > 0 ||
+	    (t->last_sent > 0 && !t->queue[t->last_sent % l]);
+
+	for (i = 0; i < t->config->nalarm_tab && !unhealthy; i++) {
+		e = &t->config->alarm_tab[i];
+		if (e->type == AL_DELAY && AVG_DELAY_KNOWN(t) &&
+		    target_delay(t) > e->low) {
+			unhealthy = 1;
+		}
+	}
+
+	if (unhealthy) {
+		t->cur_interval = t->fast_interval;
+	} else {
+		t->cur_interval = MIN(t->cur_interval * 2, t->max_interval);
+	}
+}
+
+struct target *
+find_target(const char *name, const char *srcip)
+{
+	struct target *t;
+	unsigned int key;
+
+	if (target_hash == NULL) {
+		return (NULL);
+	}
+
+	key = target_key(name, srcip);
+
+	for (t = target_hash[key & (target_hash_size - 1)]; t; t = t->hnext) {
+		if (t->hkey == key && strcmp(t->srcip, srcip) == 0 &&
+		    strcmp(t->name, name) == 0) {
+			return (t);
+		}
+	}
+
+	return (NULL);
+}
+
+struct target *
+new_target(struct target_cfg *tc, const char *name)
+{
 #ifdef HAVE_IPV6
-				memset(&hints, 0, sizeof(hints));
-				hints.ai_family = AF_INET6;
-				hints.ai_flags = AI_NUMERICHOST;
-				r = getaddrinfo(tc->name, NULL, &hints, &res);
-				if (r) {
-					r = inet_pton(AF_INET6, tc->name,
-					    &addr.addr6.sin6_addr);
-					if (!r) {
+	struct addrinfo hints, *res;
 #endif
-						logit("Bad host address: %s\n",
-						    tc->name);
-						logit("Ignoring target %s\n",
-						    tc->name);
-						continue;
+	union addr addr, srcaddr;
+	const char *srcip;
+	struct target *t;
+	int r;
+
+	if (strlen(name) >= TARGET_NAME_MAX) {
+		logit("Target name too long: %s\n", name);
+		return (NULL);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	r = inet_pton(AF_INET, name, &addr.addr4.sin_addr);
+	if (r) {
+		addr.addr.sa_family = AF_INET;
+	} else {
 #ifdef HAVE_IPV6
-					}
-				} else {
-					memcpy(&addr.addr6, res->ai_addr,
-					    res->ai_addrlen);
-					freeaddrinfo(res);
-				}
-				addr.addr.sa_family = AF_INET6;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET6;
+		hints.ai_flags = AI_NUMERICHOST;
+		r = getaddrinfo(name, NULL, &hints, &res);
+		if (r) {
+			r = inet_pton(AF_INET6, name,
+			    &addr.addr6.sin6_addr);
+			if (!r) {
 #endif
-			}
-			memset(&srcaddr, 0, sizeof(srcaddr));
-			/* XXX only for sample config run on loopback */
-			if (!tc->srcip) {
-				debug("No source IP, trying target");
-				tc->srcip = strdup(tc->name);
-			}
-			debug("Converting srcip %s", tc->srcip);
-			r = inet_pton(AF_INET, tc->srcip,
-			    &srcaddr.addr4.sin_addr);
-			if (r) {
-				srcaddr.addr.sa_family = AF_INET;
-			} else {
+				logit("Bad host address: %s\n", name);
+				logit("Ignoring target %s\n", name);
+				return (NULL);
 #ifdef HAVE_IPV6
-				memset(&hints, 0, sizeof(hints));
-				hints.ai_family = AF_INET6;
-				hints.ai_flags = AI_NUMERICHOST;
-				r = getaddrinfo(tc->srcip, NULL, &hints, &res);
-				if (r) {
-					r = inet_pton(AF_INET6, tc->srcip,
-					    &srcaddr.addr6.sin6_addr);
-					if (!r) {
+			}
+		} else {
+			memcpy(&addr.addr6, res->ai_addr, res->ai_addrlen);
+			freeaddrinfo(res);
+		}
+		addr.addr.sa_family = AF_INET6;
 #endif
-						logit("Bad srcip address %s for target %s\n",
-						    tc->srcip, tc->name);
-						logit("Ignoring target %s\n",
-						    tc->name);
-						continue;
+	}
+	memset(&srcaddr, 0, sizeof(srcaddr));
+	srcip = TARGET_SRCIP(tc, name);
+	debug("Converting srcip %s", srcip);
+	r = inet_pton(AF_INET, srcip, &srcaddr.addr4.sin_addr);
+	if (r) {
+		srcaddr.addr.sa_family = AF_INET;
+	} else {
 #ifdef HAVE_IPV6
-					}
-				} else {
-					memcpy(&srcaddr.addr6, res->ai_addr,
-					    res->ai_addrlen);
-					freeaddrinfo(res);
-				}
-				srcaddr.addr.sa_family = AF_INET6;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET6;
+		hints.ai_flags = AI_NUMERICHOST;
+		r = getaddrinfo(srcip, NULL, &hints, &res);
+		if (r) {
+			r = inet_pton(AF_INET6, srcip,
+			    &srcaddr.addr6.sin6_addr);
+			if (!r) {
 #endif
+				logit("Bad srcip address %s for target %s\n",
+				    srcip, name);
+				logit("Ignoring target %s\n", name);
+				return (NULL);
+#ifdef HAVE_IPV6
 			}
+		} else {
+			memcpy(&srcaddr.addr6, res->ai_addr, res->ai_addrlen);
+			freeaddrinfo(res);
+		}
+		srcaddr.addr.sa_family = AF_INET6;
+#endif
+	}
 
-			t = NEW(struct target, 1);
-			t->name = strdup(tc->name);
-			t->description = strdup(tc->description);
-			debug("Creating new target %s (%s)", t->name,
-			    t->description);
-			t->addr = addr;
-			t->ifaddr = srcaddr;
-			t->next = targets;
-			t->config = tc;
-			targets = t;
-
-			switch (t->addr.addr.sa_family) {
-			case AF_INET:
-				make_icmp_socket(t);
-				break;
-			case AF_INET6:
-				make_icmp6_socket(t);
-				break;
-			default:
-				break;
-			}
+	t = NEW(struct target, 1);
+	snprintf(t->name, sizeof(t->name), "%s", name);
+	t->description = tc->description;
+	debug("Creating new target %s (%s)", t->name, t->description);
+	t->addr = addr;
+	t->ifaddr = srcaddr;
+	t->next = targets;
+	t->config = tc;
+	t->srcip = TARGET_SRCIP(tc, t->name);
+	t->started = apinger_now;
+	targets = t;
+	target_hash_insert(t);
+	probe_slot_alloc(t);
+
+	backend->open(t);
+
+	configure_target(t, tc);
+	check_down(t, 0);
+
+	return (t);
+}
+
+void
+delete_target(struct target *t)
+{
+	struct target *pt;
+
+	if (targets == t) {
+		targets = t->next;
+	} else {
+		for (pt = targets; pt && pt->next != t; pt = pt->next)
+			/* empty */;
+		if (pt == NULL) {
+			return;
 		}
-		l=tc->avg_loss_delay_samples+tc->avg_loss_samples;
-		if (t->queue) {
-			if (l > (t->config->avg_loss_delay_samples+t->config->avg_loss_samples)) {
-				t->queue = realloc(t->queue, l);
-				assert(t->queue != NULL);
-				memset(t->queue+(t->config->avg_loss_delay_samples+t->config->avg_loss_samples), 0, l - (t->config->avg_loss_delay_samples+t->config->avg_loss_samples));
-			} else if (l < (t->config->avg_loss_delay_samples+t->config->avg_loss_samples)) {
-				t->queue = realloc(t->queue, l);
-				assert(t->queue != NULL);
+		pt->next = t->next;
+	}
+
+	release_target(t);
+}
+
+int
+configure_targets(struct config *cfg)
+{
+	static unsigned int generation = 0;
+	struct delayed_report *dr, *pdr, *ndr;
+	struct target *t, *pt, *nt;
+	struct target_iter it;
+	struct target_cfg *tc;
+	struct alarm_cfg *a;
+
+	generation++;
+	operation_started = apinger_gettime();
+
+	/* update or create configured targets */
+	for (tc = cfg->targets; tc; tc = tc->next) {
+		target_iter_init(&it, tc);
+		while (target_iter_next(&it)) {
+			t = find_target(it.name, TARGET_SRCIP(tc, it.name));
+			if (t == NULL) {
+				t = new_target(tc, it.name);
+				if (t == NULL) {
+					continue;
+				}
+			} else if (t->seen != generation) {
+				configure_target(t, tc);
+				t->started = operation_started;
 			}
-		} else {
-			t->queue=NEW(char,l);
-			assert(t->queue!=NULL);
+			t->seen = generation;
 		}
+	}
+
+	/* delete all unconfigured targets */
+	pt = NULL;
+
+	for (t = targets; t; t = nt) {
+		nt = t->next;
 
-		/* t->recently_lost=tc->avg_loss_samples; */
-		l=tc->avg_delay_samples;
-		if (t->rbuf) {
-			if (l > t->config->avg_delay_samples) {
-				t->rbuf= realloc(t->rbuf, sizeof(double) * l);
-				assert(t->rbuf!= NULL);
-				memset(t->queue+t->config->avg_delay_samples, 0, l - t->config->avg_delay_samples);
-			} else if (l < t->config->avg_delay_samples) {
-				int tmp;
-				for (tmp = l; tmp < t->config->avg_delay_samples;tmp++)
-					t->delay_sum -= t->rbuf[tmp];
-				t->rbuf= realloc(t->rbuf, sizeof(double) * l);
-				assert(t->rbuf!= NULL);
+		if (t->seen != generation) {
+			if (!pt) {
+				targets = nt;
+			} else {
+				pt->next = nt;
 			}
+			release_target(t);
+			continue;
+		}
+
+		pt = t;
+		check_down(t, 0);
+	}
+
+	/* rebuild the dependency graph, parents may have come or gone */
+	for (t = targets; t; t = t->next) {
+		t->parent = t->children = t->sibling = NULL;
+	}
+	for (t = targets; t; t = t->next) {
+		link_target(t);
+	}
+	for (t = targets; t; t = t->next) {
+		if (t->suppressed && !PARENT_DOWN(t)) {
+			release_suppressed(t);
+		}
+	}
+
+	pdr = NULL;
+	for (dr = delayed_reports; dr; dr = ndr) {
+		ndr = dr->next;
+		a = find_alarm(cfg, dr->a->type, dr->a->name);
+		if (a) {
+			debug("Updating delayed report for target(%s) "
+			    "and alarm(%s)", dr->t->name, a->name);
+			dr->a = a;
+			pdr = dr;
+			continue;
+		}
+		if (pdr) {
+			pdr->next = ndr;
 		} else {
-			t->rbuf = NEW(double, l);
-			assert(t->rbuf != NULL);
+			delayed_reports = ndr;
 		}
-		t->config = tc;
+		free(dr);
 	}
 
 	if (!targets) {
 		return (1);
 	}
 
-	apinger_gettime(&operation_started);
-
 	if (cfg->rrd_interval) {
 		rrd_create();
 	}
@@ -873,72 +1701,265 @@ configure_targets(struct config *cfg)
 void
 free_targets(void)
 {
-	struct active_alarm_list *al, *nal;
 	struct target *t, *nt;
 
 	/* delete all unconfigured targets */
 	for (t = targets; t; t = nt) {
 		nt = t->next;
-		for (al = t->active_alarms; al; al = nal) {
-			nal = al->next;
-			free(al);
-		}
 		if (t->socket) {
 			close(t->socket);
 		}
+		metrics_forget(t);
 		free(t->queue);
 		free(t->rbuf);
-		free(t->name);
-		free(t->description);
+		free(t->alarm_state);
+		free(t->probe);
 		free(t);
 	}
+	targets = NULL;
+
+	free(target_hash);
+	target_hash = NULL;
+	target_hash_size = target_count = 0;
+
+	free(probe_slots);
+	free(probe_slot_gen);
+	free(probe_free);
+	probe_slots = NULL;
+	probe_slot_gen = probe_free = NULL;
+	probe_slots_size = probe_slots_used = probe_nfree = 0;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*
+ * The configuration is parsed by a worker thread into a new pool, so
+ * probing goes on while a large file is read.  The worker signals
+ * completion through a pipe polled by the main loop, which then swaps
+ * the result in between two iterations.
+ */
+static pthread_t reload_thread;
+static int reload_pipe[2] = { -1, -1 };
+static int reload_running = 0;
+static int reload_again = 0;
+static struct config *reload_result;
+static int reload_status;
+
+static void *
+reload_worker(void *arg)
+{
+	char c = 0;
+
+	(void)arg;
+
+	reload_status = parse_config(config_file, &reload_result);
+	if (write(reload_pipe[1], &c, 1) < 0) {
+		myperror("write");
+	}
+
+	return (NULL);
+}
+
+static void
+reload_finish(void)
+{
+	nstime_t start;
+	char c;
+
+	if (read(reload_pipe[0], &c, 1) < 1) {
+		return;
+	}
+	pthread_join(reload_thread, NULL);
+	reload_running = 0;
+
+	if (reload_status) {
+		logit("Couldn't read config (\"%s\").", config_file);
+	} else {
+		start = self_clock();
+		apply_config(reload_result);
+		metrics_init();
+		control_init();
+		self_observe(SELF_RELOAD, start);
+	}
 }
 
 void
 reload_config(void)
 {
+	sigset_t all, old;
+	int ret;
+
+	if (reload_running) {
+		/* pick up changes made while we were parsing */
+		reload_again = 1;
+		return;
+	}
+
+	if (reload_pipe[0] < 0 && pipe(reload_pipe)) {
+		myperror("pipe");
+		return;
+	}
+
+	/* signals are for the main loop, the worker must not take them */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	ret = pthread_create(&reload_thread, NULL, reload_worker, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (ret) {
+		logit("Couldn't start config reload thread: %s",
+		    strerror(ret));
+		return;
+	}
+	reload_running = 1;
+}
+
+static int
+reload_pollfd(struct pollfd *pfd)
+{
+	if (!reload_running) {
+		return (0);
+	}
+
+	pfd->fd = reload_pipe[0];
+	pfd->events = POLLIN;
+	pfd->revents = 0;
+
+	return (1);
+}
+
+static void
+reload_stop(void)
+{
+	struct pool pool;
+
+	if (!reload_running) {
+		return;
+	}
+
+	pthread_join(reload_thread, NULL);
+	reload_running = 0;
+	if (reload_status == 0) {
+		pool = reload_result->pool;
+		pool_clear(&pool);
+	}
+}
+
+static void
+reload_process(struct pollfd *pfd, int n)
+{
+	if (n < 1 || !(pfd->revents & POLLIN)) {
+		return;
+	}
+
+	reload_finish();
+
+	if (reload_again) {
+		reload_again = 0;
+		reload_config();
+	}
+}
+#else
+void
+reload_config(void)
+{
+	nstime_t start;
+
+	start = self_clock();
 	if (load_config(config_file)) {
                 logit("Couldn't read config (\"%s\").", config_file);
 	}
+	metrics_init();
+	control_init();
+	self_observe(SELF_RELOAD, start);
+}
+
+static int
+reload_pollfd(struct pollfd *pfd)
+{
+	(void)pfd;
+
+	return (0);
+}
+
+static void
+reload_stop(void)
+{
+}
+
+static void
+reload_process(struct pollfd *pfd, int n)
+{
+	(void)pfd;
+	(void)n;
+}
+#endif
+
+/* format one status line; returns the length like snprintf() does */
+size_t
+status_line(char *buf, size_t len, struct target *t)
+{
+	struct alarm_eval *e;
+	size_t n;
+	int i;
+
+	n = catf(buf, len, 0, "%s|%s|%s|%i|%i|%ld|", t->name,
+	    t->srcip, t->description, t->last_sent + 1,
+	    t->received, (long)(t->last_received_time / NSEC_PER_SEC));
+	n = catf(buf, len, n, "%0.3fms|", target_delay(t));
+	if (AVG_LOSS_KNOWN(t)) {
+		n = catf(buf, len, n, "%0.1f%%", AVG_LOSS(t));
+	}
+	n = catf(buf, len, n, "|");
+	if (t->config->force_down == 1) {
+		n = catf(buf, len, n, "force_down");
+	} else if (t->alarms_on) {
+		for (i = 0; i < t->config->nalarm_tab; i++) {
+			e = &t->config->alarm_tab[i];
+			if (t->alarms_on & e->bit) {
+				n = catf(buf, len, n, "%s", e->alarm->name);
+			}
+		}
+	} else {
+		n = catf(buf, len, n, "none");
+	}
+	n = catf(buf, len, n, "|%lu|%lu|%0.3fms", t->duplicates,
+	    t->reordered, AVG_DELAY(t));
+
+	return (n);
 }
 
 void write_status(void){
 FILE *f;
 struct target *t;
-struct active_alarm_list *al;
-struct alarm_cfg *a;
-time_t tm;
+nstime_t start;
+char buf[1024], *line;
+size_t n;
 #if 0
 int i,qp,really_lost;
 char *buf1,*buf2;
 #endif
 
+	if (config->status_self_file) write_self_status();
 	if (config->status_file==NULL) return;
 
+	start=self_clock();
+
 	f=fopen(config->status_file,"w");
 	if (f==NULL){
 		logit("Couldn't open status file");
 		myperror(config->status_file);
 		return;
 	}
-	tm=time(NULL);
 	for(t=targets;t;t=t->next){
-		fprintf(f,"%s|%s|%s|%i|%i|%ld|",t->name, t->config->srcip, t->description, t->last_sent+1,
-			t->received, t->last_received_tv.tv_sec);
-		fprintf(f,"%0.3fms|", AVG_DELAY(t));
-		if (AVG_LOSS_KNOWN(t)){
-			fprintf(f,"%0.1f%%",AVG_LOSS(t));
-		}
-		fprintf(f, "|");
-		if (t->config->force_down == 1)
-			fprintf(f,"force_down");
-		else if (t->active_alarms){
-			for(al=t->active_alarms;al;al=al->next){
-				a=al->alarm;
-				fprintf(f,"%s",a->name);
-			}
+		line=buf;
+		n=status_line(buf,sizeof(buf),t);
+		if (n>=sizeof(buf)){
+			line=NEW(char,n+1);
+			assert(line!=NULL);
+			status_line(line,n+1,t);
 		}
-		else fprintf(f,"none");
+		fputs(line,f);
+		if (line!=buf) free(line);
 
 #if 0
 		buf1=NEW(char,t->config->avg_loss_delay_samples+1);
@@ -985,23 +2006,30 @@ char *buf1,*buf2;
 		fprintf(f,"\n");
 	}
 	fclose(f);
+	self_observe(SELF_STATUS, start);
 }
 
 void
 main_loop(void)
 {
-	struct timeval next_rrd_update = { 0, 0 };
-	struct timeval event_time, cur_time, tv;
-	struct timeval next_status = { 0, 0 };
-	struct timeval next_report = { 0, 0 };
-	struct active_alarm_list *aal;
-	struct alarm_list *al, *nal;
-	struct pollfd pfd[1024];
-	int timeout, timedelta;
+	nstime_t next_rrd_update = 0;
+	nstime_t event_time, cur_time, due, start;
+	nstime_t loop_start;
+	nstime_t next_status = 0;
+	nstime_t next_report = 0;
+	nstime_t timedelta = 0;
+	struct alarm_state *as;
+	struct pollfd *pfd = NULL;
+	struct target **pft = NULL;
+	int timeout;
+	int ret;
+	unsigned int pfd_size = 0;
 	struct alarm_cfg *a;
 	struct target *t;
 	int npfd = 0;
-	int downtime;
+	int ntfd = 0;
+	int nmfd = 0;
+	int ncfd = 0;
 	int i;
 
 	if (configure_targets(config)) {
@@ -1009,21 +2037,29 @@ main_loop(void)
 		exit(1);
 	}
 
-	memset(&pfd, '\0', sizeof pfd);
+	metrics_init();
+	control_init();
 
 	if (config->status_interval) {
-		apinger_gettime(&cur_time);
-		tv.tv_sec=config->status_interval / 1000;
-		tv.tv_usec=(config->status_interval % 1000) * 1000;
-		timeradd(&cur_time, &tv, &next_status);
+		next_status = apinger_gettime() +
+		    MSEC2NS(config->status_interval);
 	}
 
+	loop_start = self_clock();
 	while (!interrupted_by) {
 		npfd = 0;
 
-		apinger_gettime(&cur_time);
-		if (!timercmp(&next_probe, &cur_time, >)) {
-			timerclear(&next_probe);
+		/* targets plus room for the metrics, control and reload fds */
+		if (pfd_size < target_count + PFD_EXTRA) {
+			pfd_size = target_count + PFD_EXTRA;
+			pfd = realloc(pfd, sizeof(*pfd) * pfd_size);
+			pft = realloc(pft, sizeof(*pft) * pfd_size);
+			assert(pfd != NULL && pft != NULL);
+		}
+
+		cur_time = apinger_gettime();
+		if (next_probe <= cur_time) {
+			next_probe = 0;
 		}
 
 		for (t = targets; t; t = t->next) {
@@ -1031,38 +2067,37 @@ main_loop(void)
 				pfd[npfd].events =
 				    POLLIN|POLLERR|POLLHUP|POLLNVAL;
 				pfd[npfd].revents = 0;
+				pft[npfd] = t;
 				pfd[npfd++].fd = t->socket;
 			}
 
-			for (al = t->config->alarms; al ; al = nal) {
-				a = al->alarm;
-				nal = al->next;
-				if (a->type != AL_DOWN || is_alarm_on(t, a)) {
+			if (t->down_deadline &&
+			    t->down_deadline < cur_time - timedelta) {
+				check_down(t, cur_time - timedelta);
+			}
+			if (t->next_probe == 0) {
+				spread_probe(t, cur_time);
+				continue;
+			}
+			if (t->next_probe < cur_time) {
+				if (!pace_probe(cur_time,
+				    t->config->train > 1 ? t->config->train : 1)) {
 					continue;
 				}
-				if (timerisset(&t->last_received_tv)) {
-					timersub(&cur_time,
-					    &t->last_received_tv, &tv);
-				} else {
-					timersub(&cur_time,
-					    &operation_started, &tv);
-				}
-				downtime = (tv.tv_sec * 1000) +
-				    (tv.tv_usec / 1000);
-				if (timedelta > 0) {
-					downtime -= timedelta;
-				}
-				if (downtime > a->p.val) {
-					toggle_alarm(t, a, 1);
-				}
+				adapt_interval(t);
 			}
-			if (scheduled_event(&t->next_probe, &cur_time,
-			    t->config->interval)) {
-				send_probe(t);
+			due = t->next_probe;
+			if (scheduled_event(&t->next_probe, cur_time,
+			    t->cur_interval)) {
+				send_train(t);
+				/* the send time stamp refreshed apinger_now */
+				self_observe_ms(SELF_LATENESS,
+				    NS2MSEC(apinger_now - due));
+				jitter_probe(t);
 			}
 		}
 
-		apinger_gettime(&event_time);
+		event_time = apinger_gettime();
 		if (reload_request) {
 			reload_request = 0;
 			logit("SIGHUP received, reloading configuration.");
@@ -1071,29 +2106,36 @@ main_loop(void)
 		}
 
 		for (t = targets; t; t = t->next) {
-			for (aal = t->active_alarms; aal; aal = aal->next) {
-				a = aal->alarm;
-				if (a->repeat_interval <= 0) {
+			if (t->alarms_on == 0) {
+				continue;
+			}
+			for (i = 0; i < t->config->nalarm_tab; i++) {
+				a = t->config->alarm_tab[i].alarm;
+				as = &t->alarm_state[i];
+				if (!(t->alarms_on & t->config->alarm_tab[i].bit) ||
+				    (t->suppressed & t->config->alarm_tab[i].bit) ||
+				    a->repeat_interval <= 0) {
 					continue;
 				}
-				if (!scheduled_event(&aal->next_repeat,
-				    &cur_time, a->repeat_interval)) {
+				if (!scheduled_event(&as->next_repeat,
+				    cur_time, a->repeat_interval)) {
 					continue;
 				}
 				if (a->repeat_max &&
-				    aal->num_repeats >= a->repeat_max) {
+				    as->num_repeats >= a->repeat_max) {
 					continue;
 				}
-				aal->num_repeats++;
+				as->num_repeats++;
 				debug("Repeating reports...");
 				make_reports(t, a, 1);
 			}
 		}
 
 		if (config->status_interval) {
-			if (scheduled_event(&next_status, &cur_time,
+			if (scheduled_event(&next_status, cur_time,
 			    config->status_interval)) {
-				if (config->status_file) {
+				if (config->status_file ||
+				    config->status_self_file) {
 					write_status();
 				}
 				status_request = 0;
@@ -1102,7 +2144,7 @@ main_loop(void)
 
 		if (status_request) {
 			status_request = 0;
-			if (config->status_file) {
+			if (config->status_file || config->status_self_file) {
 				debug("SIGUSR1 received, writing status.");
 				write_status();
 			}
@@ -1110,89 +2152,85 @@ main_loop(void)
 		}
 
 		if (config->rrd_interval) {
-			if (scheduled_event(&next_rrd_update, &cur_time,
+			if (scheduled_event(&next_rrd_update, cur_time,
 			    config->rrd_interval)) {
+				start = self_clock();
 				rrd_update();
+				self_observe(SELF_RRD, start);
 			}
 		}
 
 		if (delayed_reports) {
-			if (timerisset(&next_report) &&
-			    timercmp(&next_report, &cur_time, <)) {
+			if (next_report != 0 && next_report < cur_time) {
 				make_delayed_reports();
-				timerclear(&next_report);
+				next_report = 0;
 			}
 		}
 		if (delayed_reports) { /* XXX merge? */
-			if (!timerisset(&next_report)) {
-				tv.tv_sec = delayed_reports->a->combine_interval / 1000;
-				tv.tv_usec = (delayed_reports->a->combine_interval % 1000) * 1000;
-				timeradd(&delayed_reports->timestamp,
-				    &tv, &next_report);
+			if (next_report == 0) {
+				next_report = delayed_reports->timestamp +
+				    MSEC2NS(delayed_reports->a->combine_interval);
 			}
-			if (!timerisset(&next_probe) ||
-			    timercmp(&next_report, &next_probe , <)) {
+			if (next_probe == 0 || next_report < next_probe) {
 				next_probe = next_report;
 			}
 		}
 
-		{
-			char buf[100];
-
-			strftime(buf, sizeof(buf), "%b %d %H:%M:%S",
-			    localtime(&next_probe.tv_sec));
-			debug("Next event scheduled for %s", buf);
-		}
-
-		apinger_gettime(&cur_time);
-		if (timercmp(&cur_time, &event_time, <)) {
-			timedelta = 0;
+		cur_time = apinger_gettime();
+		timedelta = cur_time > event_time ? cur_time - event_time : 0;
+		if (next_probe < cur_time) {
+			timeout = 0;
 		} else {
-			timersub(&cur_time, &event_time, &tv);
-			timedelta = (tv.tv_usec / 1000) + (tv.tv_sec * 1000);
+			/* round up, or we would spin for the last millisecond */
+			timeout = (next_probe - cur_time + NSEC_PER_MSEC - 1) /
+			    NSEC_PER_MSEC;
 		}
-		if (timercmp(&next_probe, &cur_time, <)) {
-			timeout = 0;
-		} else{
-			timersub(&next_probe, &cur_time, &tv);
-			timeout = (tv.tv_usec / 1000) + (tv.tv_sec * 1000);
+		if (next_probe) {
+			debug("Next event in %.3fs",
+			    (double)(next_probe - cur_time) / NSEC_PER_SEC);
 		}
+		ntfd = npfd;
+		npfd += metrics_pollfds(pfd + npfd, pfd_size - 1 - npfd);
+		nmfd = npfd;
+		npfd += control_pollfds(pfd + npfd, pfd_size - 1 - npfd);
+		ncfd = npfd;
+		npfd += reload_pollfd(pfd + npfd);
+
 		debug("Polling, timeout: %5.3fs", ((double)timeout) / 1000);
-		if (poll(pfd, npfd, timeout) < 0) {
+		self_observe(SELF_LOOP, loop_start);
+		ret = backend->poll(pfd, npfd, timeout);
+		loop_start = self_clock();
+		self_wakeups++;
+		if (ret < 0) {
 			continue;
 		}
-		apinger_gettime(&cur_time);
+		cur_time = apinger_gettime();
 
-		for (i = 0; i < npfd; i++) {
+		for (i = 0; i < ntfd; i++) {
 			if (!(pfd[i].revents & POLLIN)) {
 				continue;
 			}
 
-			for (t = targets; t; t = t->next) {
-				if (t->addr.addr.sa_family == AF_INET) {
-					if (t->socket == pfd[i].fd) {
-						recv_icmp(t, &cur_time,
-						    timedelta);
-						break;
-					}
-				} else if (t->addr.addr.sa_family == AF_INET6) {
-					if (t->socket == pfd[i].fd) {
-						recv_icmp6(t, &cur_time,
-						    timedelta);
-						break;
-					}
-				}
-			}
-
+			backend->recv(pft[i], cur_time, timedelta);
 			pfd[i].revents = 0;
 		}
+
+		metrics_process(pfd + ntfd, nmfd - ntfd);
+		control_process(pfd + nmfd, ncfd - nmfd);
+		reload_process(pfd + ncfd, npfd - ncfd);
 	}
 
 	while (delayed_reports) {
 		make_delayed_reports();
 	}
 
+	reload_stop();
+	control_close();
+	metrics_close();
 	free_targets();
-
-	free(macros_buf);
+	if (backend->close) {
+		backend->close();
+	}
+	free(pfd);
+	free(pft);
 }
@@ -54,17 +54,31 @@ union addr {
 	struct sockaddr_in6 addr6;
 };
 
-struct active_alarm_list {
-	struct alarm_cfg *alarm;
-	struct active_alarm_list *next;
+/* monotonic clock in nanoseconds, 0 means "not set" */
+typedef int64_t nstime_t;
+
+#define NSEC_PER_MSEC	1000000LL
+#define NSEC_PER_SEC	1000000000LL
+#define MSEC2NS(ms)	((nstime_t)(ms) * NSEC_PER_MSEC)
+#define NS2MSEC(ns)	((double)(ns) / NSEC_PER_MSEC)
+
+#define RTT_BUCKETS	13	/* finite buckets of the delay histogram */
+
+struct metrics_cache;
+
+/* state of an alarm, one per entry of config->alarm_tab */
+struct alarm_state {
 	int num_repeats;
-	struct timeval next_repeat;
+	nstime_t next_repeat;
+	uint64_t above;		/* replies past the high threshold, newest */
+	uint64_t below;		/* and below the low one, in bit 0 */
+	nstime_t changed;	/* last raised or cancelled on a reply */
 };
 
 
 struct target {
-	char *name;		/* name (IP address as string) */
-	char *description;	/* description */
+	char name[TARGET_NAME_MAX];	/* name (IP address as string) */
+	char *description;	/* description (owned by the config) */
 
 	union addr addr;	/* target address */
 
@@ -72,45 +86,93 @@ struct target {
 				contains info about recently sent packets
 				"1" means it was received */
 	int socket;
+	unsigned char *probe;	/* echo request, patched for every probe */
+	int probe_len;
+	uint32_t probe_sum;	/* its checksum sum without seq and trace info */
 	int last_sent;		/* sequence number of the last ping sent */
 	int last_received;	/* sequence number of the last ping received */
-	struct timeval last_received_tv; /* timestamp of the last ping received */
+	uint64_t rx_window;	/* replies seen, bit n is last_received - n */
+	unsigned long duplicates; /* duplicate replies dropped */
+	unsigned long reordered; /* replies arriving after a later one */
+	unsigned long unreachable; /* ICMP unreachables quoting our probes */
+	unsigned long time_exceeded; /* ICMP time exceeded quoting our probes */
+	nstime_t last_received_time; /* timestamp of the last ping received */
+	nstime_t started;	/* when probing (re)started, down base until a reply */
 	int received;		/* number of packets received */
 	int upreceived;		/* number of packets received during recent target uptime */
 	int upsent;		/* number of packets send during recent target uptime */
 	int recently_lost;	/* number of packets lost between
 				   last_sent-200 to last_sent-100
 				   for avg. lost computation */
-	double *rbuf;		/* bufor of received pings
+	uint32_t *rbuf;		/* delays of recently received pings in us
 				   (for avarage delay computation) */
-	double delay_sum;
-
-	struct timeval next_probe; /* time when next probe is scheduled */
-
-	struct active_alarm_list *active_alarms;
+	uint64_t delay_sum;	/* sum of rbuf, in us */
+
+	nstime_t next_probe;	/* time when next probe is scheduled */
+	int cur_interval;	/* current probe interval */
+	int max_interval;	/* adaptive backoff limit, 0 if disabled */
+	int fast_interval;	/* interval while the target looks unhealthy */
+	uint32_t slot;		/* index in the probe slot table */
+	uint32_t slot_gen;	/* generation of that slot */
+
+	int train_first;	/* sequence number of the first probe of a train */
+	int train_size;		/* probes in the current train, 0 if none */
+	int train_received;	/* replies to the current train */
+	int train_reordered;	/* replies overtaken by a later one */
+	int train_highest;	/* highest sequence number answered */
+	nstime_t train_first_time; /* first reply to the current train */
+	nstime_t train_last_time; /* last reply to the current train */
+	unsigned long trains;	/* complete trains */
+	double train_loss;	/* loss ratio of the last complete train */
+	double train_dispersion; /* ms between its first and last reply */
+	int train_reorder;	/* reordered replies in the last train */
+
+	struct alarm_state *alarm_state; /* per entry of config->alarm_tab */
+	uint64_t alarms_on;	/* bit alarm->id is set while it is active */
+	nstime_t down_deadline;	/* when the next down alarm is due, 0 if none */
+	uint64_t suppressed;	/* active alarms not reported, parent down */
+	struct target *parent;	/* target named by depends_on */
+	struct target *children; /* targets depending on this one */
+	struct target *sibling;	/* next child of the same parent */
 	struct target_cfg *config;
 
 	struct target *next;
+	struct target *hnext;	/* target hash chain */
+	unsigned int hkey;	/* hash of (srcip, name) */
+	unsigned int seen;	/* generation of the last configure_targets() */
 	union addr ifaddr;	/* iface address */
+	const char *srcip;	/* config->srcip, or name when it has none */
+
+	unsigned long received_total; /* replies received since creation */
+	unsigned long rtt_hist[RTT_BUCKETS + 1]; /* delay histogram (+Inf last) */
+	double rtt_sum;		/* sum of all delays for the histogram */
+	struct metrics_cache *metrics; /* pre-rendered metrics lines */
+	int dirty;		/* statistics changed since rendering */
 };
 
+#define TARGET_DOWN(t) ((t)->alarms_on & (t)->config->down_mask)
+#define PARENT_DOWN(t) ((t)->parent != NULL && TARGET_DOWN((t)->parent))
+
 #define AVG_DELAY_KNOWN(t) (t->upsent >= t->config->avg_delay_samples)
-#define AVG_DELAY(t) ((t->received>=t->config->avg_delay_samples)?(t->delay_sum/t->config->avg_delay_samples):((t->received>0)?(t->delay_sum/t->received):(0)))
+#define AVG_DELAY(t) (((t->received>=t->config->avg_delay_samples)?((double)t->delay_sum/t->config->avg_delay_samples):((t->received>0)?((double)t->delay_sum/t->received):(0)))/1000)
 
 #define AVG_LOSS_KNOWN(t) (t->upsent > t->config->avg_loss_delay_samples+t->config->avg_loss_samples)
 #define AVG_LOSS(t) (100*((double)t->recently_lost)/t->config->avg_loss_samples)
 
+/* probe record carried in the echo payload */
 struct trace_info {
-	struct timeval timestamp;
-	int seq;
-	void *target_id;
+	nstime_t timestamp;	/* send time */
+	uint32_t slot;		/* slot of the target */
+	uint32_t gen;		/* generation of the slot */
+	int seq;		/* full sequence number */
+	uint32_t cksum;		/* keyed hash of the fields above */
 };
 
 #ifdef FORKED_RECEIVER
 struct piped_info {
 	struct trace_info ti;
 	int icmp_seq;
-	struct timeval recv_timestamp;
+	nstime_t recv_timestamp;
 };
 #endif
 
@@ -121,22 +183,54 @@ extern char *config_file;
 
 extern uint16_t ident;
 
-extern struct timeval next_probe;
+extern nstime_t next_probe;
+extern nstime_t operation_started;
+extern nstime_t apinger_now;
 
-void apinger_gettime(struct timeval *tp);
+nstime_t apinger_gettime(void);
 
 int make_icmp_socket(struct target *t);
-void recv_icmp(struct target *t, struct timeval *, int);
+void setup_icmp_probe(struct target *t);
+void fill_icmp_probe(struct target *t, int seq);
+u_short in_cksum(const u_short *addr, int len, u_short csum);
+void recv_icmp(struct target *t, nstime_t, nstime_t);
 void send_icmp_probe(struct target *t,int seq);
 
 int make_icmp6_socket(struct target *t);
-void recv_icmp6(struct target *t, struct timeval *, int);
+void setup_icmp6_probe(struct target *t);
+void recv_icmp6(struct target *t, nstime_t, nstime_t);
 void send_icmp6_probe(struct target *t,int seq);
 
-void analyze_reply(struct timeval *time_recv,int seq,struct trace_info *ti, int);
+void analyze_reply(nstime_t time_recv,int seq,struct trace_info *ti, nstime_t);
+void make_trace_info(struct trace_info *ti, struct target *t, int seq);
+
+enum icmp_error {
+	ICMP_ERR_UNREACH,
+	ICMP_ERR_TIMXCEED
+};
+
+void analyze_error(struct target *t, int icmp_seq, enum icmp_error err);
+void send_probe(struct target *t);
+int scheduled_event(nstime_t *next_event, nstime_t cur_time,
+    int interval);
+void write_status(void);
+void free_targets(void);
 void main_loop(void);
 
-const char * subst_macros(const char *string,struct target *t,struct alarm_cfg *a,int on);
+#define TARGET_SRCIP(tc, name) ((tc)->srcip ? (tc)->srcip : (name))
+
+struct target *find_target(const char *name, const char *srcip);
+struct target *new_target(struct target_cfg *tc, const char *name);
+void link_target(struct target *t);
+void delete_target(struct target *t);
+size_t status_line(char *buf, size_t len, struct target *t);
+double target_delay(struct target *t);
+
+#define MACRO_BUF_SIZE	4096
+
+size_t expand_macros(const struct macro_template *m, char *buf, size_t len,
+    struct target *t, struct alarm_cfg *a, int on);
+const char *alarm_type_name(enum alarm_type type);
 
 void signal_handler(int);
 extern volatile int interrupted_by;
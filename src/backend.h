@@ -0,0 +1,51 @@
+/*
+ *  Alarm Pinger (c) 2002 Jacek Konieczny <jajcus@jajcus.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ */
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+struct pollfd;
+struct target;
+
+/*
+ * Packet I/O and the clock as seen by the main loop.
+ * open() sets up t->socket, a backend which doesn't need one leaves it 0
+ * and the target gets no pollfd. recv() is called for readable target
+ * sockets, poll() waits on the other (control, metrics...) descriptors.
+ * setup(), if any, applies the probe settings of t->config, on creation
+ * and on every reload.
+ */
+struct packet_backend {
+	const char	*name;
+	int		(*open)(struct target *);
+	void		(*setup)(struct target *);
+	void		(*send)(struct target *, int);
+	void		(*recv)(struct target *, nstime_t, nstime_t);
+	int		(*poll)(struct pollfd *, int, int);
+	nstime_t	(*gettime)(void);
+	void		(*close)(void);
+};
+
+extern const struct packet_backend *backend;
+extern const struct packet_backend raw_backend;
+extern const struct packet_backend sim_backend;
+
+void	sim_init(void);
+
+#endif	/* BACKEND_H */
@@ -0,0 +1,342 @@
+/*
+ *  Alarm Pinger (c) 2002 Jacek Konieczny <jajcus@jajcus.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ */
+
+/*
+ * Microbenchmarks of the daemon's hot paths ("make bench").
+ * Targets are created from a generated config file and driven through
+ * a backend which sends nothing; the results are printed as JSON, one
+ * record per benchmark and target count, with the time per operation
+ * (a target visited, or a whole call for config_parse and write_status).
+ * Benchmarks which do not depend on targets are reported once, with 0.
+ */
+
+#include "config.h"
+#include "apinger.h"
+
+#include <stdio.h>
+#ifdef HAVE_STDLIB_H
+# include <stdlib.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+
+#include "backend.h"
+#include "conf.h"
+#include "debug.h"
+
+#define BENCH_OPS	1000000	/* per-target operations per benchmark */
+
+struct bench_probe {
+	struct trace_info ti;
+	int seq;
+};
+
+static struct bench_probe *bench_probes;
+static size_t bench_nprobes;
+static size_t bench_probes_size;
+static nstime_t bench_now;
+static int bench_first = 1;
+
+static int
+bench_open(struct target *t)
+{
+	t->socket = 0;
+	return (0);
+}
+
+/* remember what would have been sent, so the replies can be faked */
+static void
+bench_send(struct target *t, int seq)
+{
+	struct bench_probe *bp;
+
+	if (bench_nprobes == bench_probes_size) {
+		bench_probes_size = bench_probes_size ?
+		    bench_probes_size * 2 : 1024;
+		bench_probes = realloc(bench_probes,
+		    bench_probes_size * sizeof(*bench_probes));
+		if (bench_probes == NULL) {
+			perror("realloc");
+			exit(1);
+		}
+	}
+	bp = &bench_probes[bench_nprobes++];
+	make_trace_info(&bp->ti, t, seq);
+	bp->seq = seq;
+}
+
+static nstime_t
+bench_gettime(void)
+{
+	return (bench_now);
+}
+
+static const struct packet_backend bench_backend = {
+	.name = "bench",
+	.open = bench_open,
+	.send = bench_send,
+	.gettime = bench_gettime,
+};
+
+static void
+bench_advance(int ms)
+{
+	bench_now += MSEC2NS(ms);
+}
+
+static double
+bench_clock(void)
+{
+	return ((double)raw_backend.gettime());
+}
+
+static void
+bench_report(const char *name, int ntargets, unsigned long ops, double ns)
+{
+	printf("%s\n    {\"name\": \"%s\", \"targets\": %i, \"ops\": %lu, "
+	    "\"ns_per_op\": %.1f}", bench_first ? "" : ",",
+	    name, ntargets, ops, ops ? ns / ops : 0.0);
+	bench_first = 0;
+	fflush(stdout);
+}
+
+static int
+bench_write_config(const char *path, const char *status_file, int ntargets)
+{
+	FILE *f;
+	int i;
+
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		return (-1);
+	}
+	fprintf(f, "status { file \"%s\" }\n", status_file);
+	fprintf(f, "alarm default { command on \"/bin/echo %%s %%r: "
+	    "%%T(%%t) %%a %%A %%p/%%P %%l %%d\" }\n");
+	fprintf(f, "alarm down \"down\" { time 30s }\n");
+	fprintf(f, "alarm loss \"loss\" { percent_low 10; percent_high 20 }\n");
+	fprintf(f, "alarm delay \"delay\" { delay_low 100ms; "
+	    "delay_high 200ms }\n");
+	fprintf(f, "target default { interval 1s; "
+	    "alarms \"down\",\"loss\",\"delay\" }\n");
+	for (i = 1; i <= ntargets; i++) {
+		fprintf(f, "target \"10.%i.%i.%i\" { description \"bench\" }\n",
+		    (i >> 16) & 0xff, (i >> 8) & 0xff, i & 0xff);
+	}
+
+	return (fclose(f));
+}
+
+/* the checksum of a full size Ethernet payload */
+static void
+bench_cksum(void)
+{
+	static u_short cksum_buf[1472 / 2];
+	volatile u_short cksum = 0;
+	double start;
+	int i;
+
+	start = bench_clock();
+	for (i = 0; i < BENCH_OPS / 10; i++) {
+		cksum += in_cksum(cksum_buf, sizeof(cksum_buf), cksum);
+	}
+	bench_report("in_cksum_1472", 0, BENCH_OPS / 10,
+	    bench_clock() - start);
+}
+
+static int
+bench_run(int ntargets, const char *config_path, const char *status_path)
+{
+	char buf[MACRO_BUF_SIZE];
+	struct config *cfg;
+	struct alarm_cfg *a;
+	struct target *t;
+	struct pool pool;
+	int rounds, reps, i;
+	double start, ns, ns2;
+	unsigned long ops;
+	size_t n;
+
+	if (bench_write_config(config_path, status_path, ntargets)) {
+		return (-1);
+	}
+
+	reps = BENCH_OPS / 10 / ntargets;
+	if (reps < 1) {
+		reps = 1;
+	}
+	rounds = BENCH_OPS / ntargets;
+	if (rounds < 1) {
+		rounds = 1;
+	}
+
+	start = bench_clock();
+	for (i = 0; i < reps; i++) {
+		if (parse_config(config_path, &cfg)) {
+			fprintf(stderr, "Couldn't parse %s\n", config_path);
+			return (-1);
+		}
+		pool = cfg->pool;
+		pool_clear(&pool);
+	}
+	bench_report("config_parse", ntargets, reps, bench_clock() - start);
+
+	if (load_config(config_path)) {
+		return (-1);
+	}
+	start = bench_clock();
+	if (configure_targets(config)) {
+		return (-1);
+	}
+	bench_report("configure_targets", ntargets, ntargets,
+	    bench_clock() - start);
+
+	/*
+	 * One probe per target and round, answered 10ms later, the way
+	 * main_loop() would see it with all targets due at once.
+	 */
+	ns = ns2 = 0;
+	for (i = 0; i < rounds; i++) {
+		bench_nprobes = 0;
+		start = bench_clock();
+		for (t = targets; t; t = t->next) {
+			send_probe(t);
+		}
+		ns += bench_clock() - start;
+
+		bench_advance(10);
+		start = bench_clock();
+		for (n = 0; n < bench_nprobes; n++) {
+			analyze_reply(bench_now, bench_probes[n].seq & 0xffff,
+			    &bench_probes[n].ti, 0);
+		}
+		ns2 += bench_clock() - start;
+		bench_advance(990);
+	}
+	ops = (unsigned long)rounds * ntargets;
+	bench_report("send_probe", ntargets, ops, ns);
+	bench_report("analyze_reply", ntargets, ops, ns2);
+
+	/* the packet work of send_icmp_probe(), without the syscall */
+	for (t = targets; t; t = t->next) {
+		setup_icmp_probe(t);
+	}
+	start = bench_clock();
+	for (i = 0; i < rounds; i++) {
+		for (t = targets; t; t = t->next) {
+			fill_icmp_probe(t, i);
+		}
+	}
+	bench_report("fill_icmp_probe", ntargets, ops, bench_clock() - start);
+
+	/* the per-iteration scan of main_loop(), one millisecond apart */
+	start = bench_clock();
+	for (i = 0; i < rounds; i++) {
+		for (t = targets; t; t = t->next) {
+			scheduled_event(&t->next_probe, bench_now,
+			    t->cur_interval);
+		}
+		bench_advance(1);
+	}
+	bench_report("scheduled_event", ntargets, ops, bench_clock() - start);
+
+	a = find_alarm(config, AL_DOWN, "down");
+	if (a == NULL) {
+		return (-1);
+	}
+	start = bench_clock();
+	for (i = 0; i < rounds; i++) {
+		for (t = targets; t; t = t->next) {
+			expand_macros(a->command_on_tmpl, buf, sizeof(buf),
+			    t, a, 1);
+		}
+	}
+	bench_report("expand_macros", ntargets, ops, bench_clock() - start);
+
+	start = bench_clock();
+	for (i = 0; i < reps; i++) {
+		write_status();
+	}
+	bench_report("write_status", ntargets, reps, bench_clock() - start);
+
+	free_targets();
+	free_config();
+	config = NULL;
+
+	return (0);
+}
+
+int
+main(int argc, char **argv)
+{
+	char config_path[] = "/tmp/apinger-bench.conf.XXXXXX";
+	char status_path[] = "/tmp/apinger-bench.status.XXXXXX";
+	static const int sizes[] = { 1000, 10000, 100000 };
+	int fd, ret, i, n, ntargets;
+
+	for (i = 1; i < argc; i++) {
+		if (atoi(argv[i]) <= 0) {
+			fprintf(stderr, "Usage: apinger-bench [<targets>...]\n");
+			return (1);
+		}
+	}
+
+	fd = mkstemp(config_path);
+	if (fd < 0) {
+		perror("mkstemp");
+		return (1);
+	}
+	close(fd);
+	fd = mkstemp(status_path);
+	if (fd < 0) {
+		perror("mkstemp");
+		unlink(config_path);
+		return (1);
+	}
+	close(fd);
+
+	ident = getpid() & 0xFFFF;
+	srandom(1);
+	backend = &bench_backend;
+	bench_now = raw_backend.gettime();
+
+	printf("{\n  \"package\": \"" PACKAGE_STRING "\",\n  \"benchmarks\": [");
+
+	bench_cksum();
+
+	ret = 0;
+	n = argc > 1 ? argc - 1 : (int)(sizeof(sizes) / sizeof(sizes[0]));
+	for (i = 0; i < n && ret == 0; i++) {
+		ntargets = argc > 1 ? atoi(argv[i + 1]) : sizes[i];
+		ret = bench_run(ntargets, config_path, status_path);
+	}
+
+	printf("\n  ]\n}\n");
+
+	unlink(config_path);
+	unlink(status_path);
+	free(bench_probes);
+
+	return (ret ? 1 : 0);
+}
@@ -46,7 +46,7 @@ struct target_cfg *cur_target;
 
 %verbose
 %locations
-%expect 14
+%expect 20
 %union {
 	int i;
 	char *s;
@@ -54,6 +54,7 @@ struct target_cfg *cur_target;
 	struct target_cfg *t;
 	struct config *c;
 	struct alarm_list *al;
+	struct string_list *sl;
 }
 
 %token <i> TIME
@@ -70,8 +71,12 @@ struct target_cfg *cur_target;
 
 
 %token STATUS
+%token METRICS
+%token CONTROL
+%token LISTEN
 %token ALARM
 %token TARGET
+%token RANGE
 
 %token OVERRIDE
 %token DEFAULT
@@ -84,6 +89,7 @@ struct target_cfg *cur_target;
 %token PIPE
 %token COMBINE
 %token REPEAT
+%token HOLD
 
 %token DOWN
 %token LOSS
@@ -97,14 +103,31 @@ struct target_cfg *cur_target;
 
 %token DESCRIPTION
 %token SRCIP
+%token DEPENDS_ON
 %token ALARMS
 %token FORCE_DOWN
 %token INTERVAL
+%token MAX_INTERVAL
+%token FAST_INTERVAL
+%token JITTER
+%token TRAIN
+%token SIZE
+%token TOS
+%token TRAFFIC_CLASS
+%token DF
+%token UNREACHABLE
+%token MAX_PPS
+%token SIMULATE
+%token CALIBRATE
+%token SAMPLES
+%token REORDER
+%token DURATION
 %token AVG_DELAY_SAMPLES
 %token AVG_LOSS_SAMPLES
 %token AVG_LOSS_DELAY_SAMPLES
 
 %token FILE_
+%token SELF_FILE
 
 %token ERROR
 
@@ -114,13 +137,18 @@ struct target_cfg *cur_target;
 
 %type <s> string
 %type <al> alarmlist
+%type <sl> addresslist
 %type <a> makealarm getdefalarm
 %type <t> maketarget getdeftarget
 %type <i> boolean
 
 %%
 
-config:	/* */
+config:	statement
+	| config separator statement
+;
+
+statement: /* */
 	| DEBUG boolean { cur_config.debug=$2; }
 	| USER string { cur_config.user=$2; }
 	| GROUP string { cur_config.group=$2; }
@@ -128,10 +156,15 @@ config:	/* */
 	| TIMESTAMP_FORMAT string { cur_config.timestamp_format=$2; }
 	| PID_FILE string { cur_config.pid_file=$2; }
 	| STATUS '{' statuscfg '}'
+	| METRICS '{' metricscfg '}'
+	| CONTROL '{' controlcfg '}'
+	| SIMULATE '{' simulatecfg '}'
+	| CALIBRATE '{' calibratecfg '}'
+		{ cur_config.calibrate=1; }
 	| RRD INTERVAL TIME { cur_config.rrd_interval=$3; }
+	| MAX_PPS INTEGER { cur_config.max_pps=$2; }
 	| alarm
 	| target
-	| config separator config
 	| error
 		{
 			logit("Configuration file syntax error. Line %i, character %i",
@@ -174,6 +207,11 @@ alarm:	ALARM getdefalarm DEFAULT '{' alarmcommoncfg '}'
 			cur_alarm->name=$4;
 			add_alarm(AL_DELAY);
 		}
+	| ALARM makealarm UNREACHABLE string '{' alarmcommoncfg '}'
+		{
+			cur_alarm->name=$4;
+			add_alarm(AL_UNREACH);
+		}
 ;
 
 alarmcommoncfg: alarmcommon
@@ -181,6 +219,7 @@ alarmcommoncfg: alarmcommon
 ;
 
 alarmlosscfg: alarmcommon
+	| alarmfilter
 	| PERCENT_LOW INTEGER
 		{ cur_alarm->p.lh.low=$2; }
 	| PERCENT_HIGH INTEGER
@@ -189,6 +228,7 @@ alarmlosscfg: alarmcommon
 ;
 
 alarmdelaycfg: alarmcommon
+	| alarmfilter
 	| DELAY_LOW TIME
 		{ cur_alarm->p.lh.low=$2; }
 	| DELAY_HIGH TIME
@@ -196,6 +236,12 @@ alarmdelaycfg: alarmcommon
 	| alarmdelaycfg separator alarmdelaycfg
 ;
 
+alarmfilter: SAMPLES INTEGER INTEGER
+		{ cur_alarm->need=$2; cur_alarm->window=$3; }
+	| HOLD TIME
+		{ cur_alarm->hold=$2; }
+;
+
 alarmdowncfg: alarmcommon
 	| TIME_ TIME
 		{ cur_alarm->p.val=$2; }
@@ -239,9 +285,18 @@ alarmcommon: /* */
 
 
 target:	TARGET getdeftarget DEFAULT '{' targetcfg '}'
-	| TARGET maketarget string '{' targetcfg '}'
+	| TARGET maketarget addresslist '{' targetcfg '}'
 		{
-			cur_target->name=$3;
+			$3=reverse_list($3);
+			cur_target->name=$3->str;
+			if ($3->next)
+				cur_target->addresses=$3;
+			add_target();
+		}
+	| TARGET maketarget RANGE string '{' targetcfg '}'
+		{
+			cur_target->name=$4;
+			cur_target->range=1;
 			add_target();
 		}
 ;
@@ -251,6 +306,8 @@ targetcfg: /* */
 		{ cur_target->description=$2; }
 	| SRCIP string
 		{ cur_target->srcip = $2; }
+	| DEPENDS_ON string
+		{ cur_target->depends_on = $2; }
 	| ALARMS alarmlist
 		{ cur_target->alarms=$2; }
 	| ALARMS OVERRIDE alarmlist
@@ -261,6 +318,22 @@ targetcfg: /* */
 		{ cur_target->interval=$2; }
 	| INTERVAL TIME
 		{ cur_target->interval=$2; }
+	| MAX_INTERVAL TIME
+		{ cur_target->max_interval=$2; }
+	| FAST_INTERVAL TIME
+		{ cur_target->fast_interval=$2; }
+	| JITTER TIME
+		{ cur_target->jitter=$2; }
+	| TRAIN INTEGER
+		{ cur_target->train=$2; }
+	| SIZE INTEGER
+		{ cur_target->size=$2; }
+	| TOS INTEGER
+		{ cur_target->tos=$2; }
+	| TRAFFIC_CLASS INTEGER
+		{ cur_target->tos=$2; }
+	| DF boolean
+		{ cur_target->df=$2; }
 	| AVG_DELAY_SAMPLES INTEGER
 		{ cur_target->avg_delay_samples=$2; }
 	| AVG_LOSS_SAMPLES INTEGER
@@ -278,9 +351,17 @@ alarmlist: string
 		{ $$=alarm2list($3,$1); }
 ;
 
+addresslist: string
+		{ $$=string2list($1,NULL); }
+	| addresslist ',' string
+		{ $$=string2list($3,$1); }
+;
+
 statuscfg: /* */
 	| FILE_ string
 		{ cur_config.status_file=$2; }
+	| SELF_FILE string
+		{ cur_config.status_self_file=$2; }
 	| INTERVAL INTEGER
 		{ cur_config.status_interval=$2; }
 	| INTERVAL TIME
@@ -288,6 +369,40 @@ statuscfg: /* */
 	| statuscfg separator statuscfg
 ;
 
+metricscfg: /* */
+	| LISTEN string
+		{ cur_config.metrics_listen=$2; }
+	| metricscfg separator metricscfg
+;
+
+controlcfg: /* */
+	| LISTEN string
+		{ cur_config.control_socket=$2; }
+	| controlcfg separator controlcfg
+;
+
+calibratecfg: /* */
+	| INTERVAL TIME
+		{ cur_config.calibrate_interval=$2; }
+	| SAMPLES INTEGER
+		{ cur_config.calibrate_samples=$2; }
+	| calibratecfg separator calibratecfg
+;
+
+simulatecfg: /* */
+	| DELAY TIME
+		{ cur_config.sim_delay=$2; }
+	| JITTER TIME
+		{ cur_config.sim_jitter=$2; }
+	| LOSS INTEGER
+		{ cur_config.sim_loss=$2; }
+	| REORDER INTEGER
+		{ cur_config.sim_reorder=$2; }
+	| DURATION TIME
+		{ cur_config.sim_duration=$2; }
+	| simulatecfg separator simulatecfg
+;
+
 
 string: STRING	{ $$=pool_strdup(&cur_config.pool,$1); }
 ;
@@ -28,6 +28,15 @@
 #ifdef HAVE_STRING_H
 # include <string.h>
 #endif
+#ifdef HAVE_SYS_TYPES_H
+# include <sys/types.h>
+#endif
+#ifdef HAVE_SYS_SOCKET_H
+# include <sys/socket.h>
+#endif
+#ifdef HAVE_ARPA_INET_H
+# include <arpa/inet.h>
+#endif
 #include "conf.h"
 #include "cfgparser1.h"
 
@@ -41,69 +50,226 @@
 
 struct config *config = NULL;
 
+#define POOL_ALIGN	(2 * sizeof(void *))
+#define POOL_HDR_SIZE \
+    ((sizeof(struct pool_chunk) + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1))
+
 void *
-pool_malloc(struct pool_item **pool, size_t size)
+pool_malloc(struct pool *pool, size_t size)
 {
-	struct pool_item *pi;
-	char *p;
+	struct pool_chunk *pc;
+	size_t csize;
+
+	size = (size + POOL_ALIGN - 1) & ~(POOL_ALIGN - 1);
 
-	p = calloc(1, size + sizeof(struct pool_item));
+	pc = pool->chunks;
+	if (pc == NULL || pc->size - pc->used < size) {
+		csize = POOL_CHUNK_SIZE - POOL_HDR_SIZE;
+		if (size > csize / 4) {
+			/* big objects get a chunk of their own */
+			csize = size;
+		}
 
-	assert(p != NULL);
+		pc = calloc(1, POOL_HDR_SIZE + csize);
+		assert(pc != NULL);
+		pc->size = csize;
+
+		if (csize == size && pool->chunks != NULL) {
+			/* keep filling the current chunk */
+			pc->next = pool->chunks->next;
+			pool->chunks->next = pc;
+		} else {
+			pc->next = pool->chunks;
+			pool->chunks = pc;
+		}
+	}
 
-	pi = (struct pool_item *)p;
-	p += sizeof(struct pool_item);
-	pi->next = *pool;
-	*pool = pi;
+	pc->used += size;
 
-	return (p);
+	return ((char *)pc + POOL_HDR_SIZE + pc->used - size);
 }
 
 char *
-pool_strdup(struct pool_item **pool, const char *str)
+pool_strdup(struct pool *pool, const char *str)
 {
+	unsigned int i, j, size;
+	char **old;
+	size_t len;
 	char *p;
 
 	assert(str != NULL);
 
-	p = pool_malloc(pool, strlen(str) + 1);
-	strcpy(p, str);
+	if (pool->strings_count >= pool->strings_size / 2) {
+		old = pool->strings;
+		size = pool->strings_size;
+		pool->strings_size = size ? size * 2 : 64;
+		pool->strings = calloc(pool->strings_size, sizeof(char *));
+		assert(pool->strings != NULL);
+		for (j = 0; j < size; j++) {
+			if (old[j] == NULL) {
+				continue;
+			}
+			for (i = hash_string(HASH_INIT, old[j]) &
+			    (pool->strings_size - 1); pool->strings[i];
+			    i = (i + 1) & (pool->strings_size - 1))
+				/* empty */;
+			pool->strings[i] = old[j];
+		}
+		free(old);
+	}
+
+	for (i = hash_string(HASH_INIT, str) & (pool->strings_size - 1);
+	    pool->strings[i]; i = (i + 1) & (pool->strings_size - 1)) {
+		if (strcmp(pool->strings[i], str) == 0) {
+			return (pool->strings[i]);
+		}
+	}
+
+	len = strlen(str) + 1;
+	p = pool_malloc(pool, len);
+	memcpy(p, str, len);
+
+	pool->strings[i] = p;
+	pool->strings_count++;
 
 	return (p);
 }
 
 void
-pool_free(struct pool_item **pool, void *ptr)
+pool_free(struct pool *pool, void *ptr)
 {
-	struct pool_item *pi, *pi1;
+	/* memory is only returned by pool_clear() */
+	(void)pool;
+	(void)ptr;
+}
 
-	pi1 = NULL;
+void
+pool_clear(struct pool *pool)
+{
+	struct pool_chunk *pc, *npc;
 
-	for (pi = *pool; pi; pi = pi->next) {
-		if (pi + 1 == ptr) {
-			if (pi1) {
-				pi1->next = pi->next;
-			} else {
-				*pool = pi->next;
-			}
-			free(pi);
-			return;
+	for (pc = pool->chunks; pc; pc = npc) {
+		npc = pc->next;
+		free(pc);
+	}
+
+	free(pool->strings);
+	memset(pool, 0, sizeof(*pool));
+}
+
+/* FNV-1a */
+unsigned int
+hash_string(unsigned int h, const char *str)
+{
+	const unsigned char *p;
+
+	for (p = (const unsigned char *)str; *p; p++) {
+		h ^= *p;
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+static unsigned int
+alarm_key(enum alarm_type type, const char *name)
+{
+	return (hash_string(HASH_INIT ^ (unsigned int)type, name));
+}
+
+static int
+index_alarms(struct config *cfg)
+{
+	struct alarm_cfg *a;
+	unsigned int n, b;
+
+	for (n = 0, a = cfg->alarms; a; a = a->next) {
+		a->id = n++;
+	}
+	if (n > ALARMS_MAX) {
+		fprintf(stderr, "Too many alarms defined (%u, at most %i).\n",
+		    n, ALARMS_MAX);
+		return (-1);
+	}
+	cfg->nalarms = n;
+	for (cfg->alarm_hash_size = 16; cfg->alarm_hash_size < 2 * n;
+	    cfg->alarm_hash_size *= 2)
+		/* empty */;
+
+	cfg->alarm_hash = PNEW(cfg->pool, struct alarm_cfg *,
+	    cfg->alarm_hash_size);
+
+	for (a = cfg->alarms; a; a = a->next) {
+		b = alarm_key(a->type, a->name) & (cfg->alarm_hash_size - 1);
+		a->hnext = cfg->alarm_hash[b];
+		cfg->alarm_hash[b] = a;
+	}
+
+	return (0);
+}
+
+struct alarm_cfg *
+find_alarm(struct config *cfg, enum alarm_type type, const char *name)
+{
+	struct alarm_cfg *a;
+	unsigned int b;
+
+	if (cfg->alarm_hash == NULL) {
+		return (NULL);
+	}
+
+	b = alarm_key(type, name) & (cfg->alarm_hash_size - 1);
+	for (a = cfg->alarm_hash[b]; a; a = a->hnext) {
+		if (a->type == type && strcmp(a->name, name) == 0) {
+			return (a);
 		}
-		pi1 = pi;
 	}
 
-	fprintf(stderr, "poll_free: pointer not from the pool\n");
-	exit(1);
+	return (NULL);
 }
 
-void
-pool_clear(struct pool_item **pool)
+/* build the evaluation table of the alarms of a target */
+static void
+compile_alarms(struct config *cfg, struct target_cfg *tc)
 {
-	struct pool_item *pi, *pi1;
+	struct alarm_list *al;
+	struct alarm_eval *e;
+	struct alarm_cfg *a;
+	uint64_t mask;
+	int n;
 
-	for (pi = *pool; pi; pi = pi1) {
-		pi1 = pi->next;
-		free(pi);
+	for (n = 0, al = tc->alarms; al; al = al->next) {
+		n++;
+	}
+	tc->alarm_tab = PNEW(cfg->pool, struct alarm_eval, n);
+	tc->nalarm_tab = 0;
+	tc->down_mask = 0;
+	tc->down_time = 0;
+
+	mask = 0;
+	for (al = tc->alarms; al; al = al->next) {
+		a = al->alarm;
+		if (mask & ((uint64_t)1 << a->id)) {
+			/* listed both for the target and by default */
+			continue;
+		}
+		e = &tc->alarm_tab[tc->nalarm_tab++];
+		e->alarm = a;
+		e->bit = (uint64_t)1 << a->id;
+		e->type = a->type;
+		e->low = a->p.lh.low;
+		e->high = a->p.lh.high;
+		e->need = a->need;
+		e->window_mask = a->window < 64 ?
+		    ((uint64_t)1 << a->window) - 1 : ~(uint64_t)0;
+		e->hold = a->hold;
+		mask |= e->bit;
+		if (a->type == AL_DOWN) {
+			tc->down_mask |= e->bit;
+			if (tc->down_time == 0 || a->p.val < tc->down_time) {
+				tc->down_time = a->p.val;
+			}
+		}
 	}
 }
 
@@ -120,6 +286,8 @@ make_target(void)
 {
 	cur_target = PNEW(cur_config.pool, struct target_cfg, 1);
 	memset(cur_target, 0, sizeof(struct target_cfg));
+	cur_target->tos = -1;
+	cur_target->df = -1;
 	return (cur_target);
 }
 
@@ -164,13 +332,237 @@ alarm2list(const char *aname, struct alarm_list *list)
 	return (al);
 }
 
+struct string_list *
+string2list(const char *str, struct string_list *list)
+{
+	struct string_list *sl;
+
+	sl = PNEW(cur_config.pool, struct string_list, 1);
+	sl->str = (char *)str;
+	sl->next = list;
+
+	return (sl);
+}
+
+/* string2list() prepends, this restores the order of the config file */
+struct string_list *
+reverse_list(struct string_list *list)
+{
+	struct string_list *sl, *rev = NULL;
+
+	while (list) {
+		sl = list;
+		list = list->next;
+		sl->next = rev;
+		rev = sl;
+	}
+
+	return (rev);
+}
+
+struct macro_template *
+compile_macros(struct pool *pool, const char *str)
+{
+	struct macro_template *m;
+	struct macro_token *mt;
+	const char *p;
+	int n;
+
+	if (str == NULL || str[0] == '\0') {
+		return (NULL);
+	}
+
+	/* every character may start a token at worst */
+	for (n = 0, p = str; *p; p++) {
+		n++;
+	}
+
+	m = pool_malloc(pool, sizeof(*m) + n * sizeof(struct macro_token));
+	mt = NULL;
+
+	for (p = str; *p; p++) {
+		if (*p == '%') {
+			p++;
+			if (*p == '\0') {
+				break;
+			}
+			if (*p != '%') {
+				mt = &m->tokens[m->ntokens++];
+				mt->macro = *p;
+				mt = NULL;
+				continue;
+			}
+			/* "%%" is a literal '%', starting a new span */
+			mt = NULL;
+		}
+		if (mt == NULL) {
+			mt = &m->tokens[m->ntokens++];
+			mt->text = p;
+		}
+		mt->len++;
+	}
+
+	return (m);
+}
+
+void
+target_iter_init(struct target_iter *it, struct target_cfg *tc)
+{
+	char buf[TARGET_NAME_MAX], *p, *end;
+	int bits, hostbits, i;
+	long len;
+
+	memset(it, 0, sizeof(*it));
+	it->tc = tc;
+
+	if (tc->addresses) {
+		it->list = tc->addresses;
+		return;
+	}
+	if (!tc->range) {
+		it->end = 1;
+		return;
+	}
+
+	snprintf(buf, sizeof(buf), "%s", tc->name);
+	p = strchr(buf, '/');
+	if (p == NULL) {
+		goto bad;
+	}
+	*p++ = '\0';
+	len = strtol(p, &end, 10);
+	if (*p == '\0' || *end != '\0') {
+		goto bad;
+	}
+
+	if (inet_pton(AF_INET, buf, it->base) == 1) {
+		it->family = AF_INET;
+		bits = 32;
+#ifdef AF_INET6
+	} else if (inet_pton(AF_INET6, buf, it->base) == 1) {
+		it->family = AF_INET6;
+		bits = 128;
+#endif
+	} else {
+		goto bad;
+	}
+	if (len < 0 || len > bits) {
+		goto bad;
+	}
+
+	hostbits = bits - len;
+	if (hostbits > 30 || (1UL << hostbits) > TARGET_RANGE_MAX) {
+		logit("Target range %s has more than %i addresses",
+		    tc->name, TARGET_RANGE_MAX);
+		logit("Ignoring target %s", tc->name);
+		return;
+	}
+
+	for (i = len; i < bits; i++) {
+		it->base[i / 8] &= ~(0x80 >> (i % 8));
+	}
+
+	it->end = 1UL << hostbits;
+
+	/* skip the network and broadcast addresses of IPv4 subnets */
+	if (it->family == AF_INET && hostbits > 1) {
+		it->pos = 1;
+		it->end--;
+	}
+
+	return;
+bad:
+	logit("Bad target range: %s", tc->name);
+	logit("Ignoring target %s", tc->name);
+}
+
+int
+target_iter_next(struct target_iter *it)
+{
+	unsigned char addr[16];
+	unsigned long v;
+	int i, n;
+
+	if (it->list) {
+		snprintf(it->name, sizeof(it->name), "%s", it->list->str);
+		it->list = it->list->next;
+		return (1);
+	}
+
+	if (it->pos >= it->end) {
+		return (0);
+	}
+
+	if (!it->family) {
+		snprintf(it->name, sizeof(it->name), "%s", it->tc->name);
+		it->pos++;
+		return (1);
+	}
+
+	n = it->family == AF_INET ? 4 : 16;
+	memcpy(addr, it->base, n);
+	v = it->pos++;
+	for (i = n - 1; i >= 0 && v; i--) {
+		v += addr[i];
+		addr[i] = v & 0xff;
+		v >>= 8;
+	}
+	inet_ntop(it->family, addr, it->name, sizeof(it->name));
+
+	return (1);
+}
+
+/*
+ * The calibration target probes the loopback address, its replies tell
+ * how much of a measured delay is our own latency.  No alarms are set
+ * for it.
+ */
+static void
+add_calibration_target(void)
+{
+	struct target_cfg *tc;
+
+	/* a configured loopback target is used as it is */
+	for (tc = cur_config.targets; tc; tc = tc->next) {
+		if (!tc->range && !tc->addresses &&
+		    strcmp(tc->name, "127.0.0.1") == 0 &&
+		    (!tc->srcip || strcmp(tc->srcip, "127.0.0.1") == 0)) {
+			tc->calibration = 1;
+			return;
+		}
+	}
+
+	tc = PNEW(cur_config.pool, struct target_cfg, 1);
+	memset(tc, 0, sizeof(*tc));
+	tc->name = "127.0.0.1";
+	tc->srcip = "127.0.0.1";
+	tc->description = "calibration";
+	tc->calibration = 1;
+	tc->interval = cur_config.calibrate_interval;
+	tc->max_interval = tc->fast_interval = tc->interval;
+	tc->avg_delay_samples = cur_config.calibrate_samples;
+	if (tc->avg_delay_samples > CALIBRATE_SAMPLES_MAX) {
+		tc->avg_delay_samples = CALIBRATE_SAMPLES_MAX;
+	}
+	tc->train = 1;
+	tc->df = -1;
+	tc->alarms_override = 1;
+	tc->next = cur_config.targets;
+	cur_config.targets = tc;
+}
+
 extern FILE *yyin, *yyout;
 extern YYLTYPE yylloc;
 extern int yydebug;
 int yyparse(void);
 
+/*
+ * Parse the file into a fresh configuration without touching the active
+ * one.  Only the parser globals are used, so this may run in a separate
+ * thread while the main loop keeps probing.
+ */
 int
-load_config(const char *filename)
+parse_config(const char *filename, struct config **cfgp)
 {
 	struct alarm_list *al;
 	struct target_cfg *t;
@@ -215,6 +607,14 @@ load_config(const char *filename)
 			if (!a->pipe_off) {
 				a->pipe_off = cur_config.alarm_defaults.pipe_off;
 			}
+			a->command_on_tmpl =
+			    compile_macros(&cur_config.pool, a->command_on);
+			a->command_off_tmpl =
+			    compile_macros(&cur_config.pool, a->command_off);
+			a->pipe_on_tmpl =
+			    compile_macros(&cur_config.pool, a->pipe_on);
+			a->pipe_off_tmpl =
+			    compile_macros(&cur_config.pool, a->pipe_off);
 			if (!a->combine_interval) {
 				a->combine_interval = cur_config.alarm_defaults.combine_interval;
 			}
@@ -222,6 +622,25 @@ load_config(const char *filename)
 				a->repeat_interval = cur_config.alarm_defaults.repeat_interval;
 				a->repeat_max = cur_config.alarm_defaults.repeat_max;
 			}
+			if (a->window <= 0) {
+				a->window = a->need = 1;
+			}
+			if (a->window > WINDOW_MAX) {
+				logit("Sample window of alarm %s cut to %i",
+				    a->name, WINDOW_MAX);
+				a->window = WINDOW_MAX;
+			}
+			if (a->need <= 0 || a->need > a->window) {
+				a->need = a->window;
+			}
+		}
+
+		cur_config.target_defaults.rrd_filename_tmpl =
+		    compile_macros(&cur_config.pool,
+		    cur_config.target_defaults.rrd_filename);
+
+		if (cur_config.calibrate) {
+			add_calibration_target();
 		}
 
 		for (t = cur_config.targets; t; t = t->next) {
@@ -231,9 +650,33 @@ load_config(const char *filename)
 			if (t->interval <= 0) {
 				t->interval = cur_config.target_defaults.interval;
 			}
+			if (t->max_interval <= 0) {
+				t->max_interval = cur_config.target_defaults.max_interval;
+			}
+			if (t->fast_interval <= 0) {
+				t->fast_interval = cur_config.target_defaults.fast_interval;
+			}
+			if (t->jitter <= 0) {
+				t->jitter = cur_config.target_defaults.jitter;
+			}
+			if (t->train <= 0) {
+				t->train = cur_config.target_defaults.train;
+			}
+			if (t->train > TRAIN_MAX) {
+				logit("Probe train of target %s cut to %i probes",
+				    t->name, TRAIN_MAX);
+				t->train = TRAIN_MAX;
+			}
 			if (t->avg_delay_samples <= 0) {
 				t->avg_delay_samples = cur_config.target_defaults.avg_delay_samples;
 			}
+			/* also a configured loopback or a defaulted sample count */
+			if (t->calibration &&
+			    t->avg_delay_samples > CALIBRATE_SAMPLES_MAX) {
+				logit("Delay samples of calibration target %s cut "
+				    "to %i", t->name, CALIBRATE_SAMPLES_MAX);
+				t->avg_delay_samples = CALIBRATE_SAMPLES_MAX;
+			}
 			if (t->avg_loss_samples <= 0) {
 				t->avg_loss_samples = cur_config.target_defaults.avg_loss_samples;
 			}
@@ -242,10 +685,36 @@ load_config(const char *filename)
 			}
 			if (!t->rrd_filename) {
 				t->rrd_filename = cur_config.target_defaults.rrd_filename;
+				t->rrd_filename_tmpl = cur_config.target_defaults.rrd_filename_tmpl;
+			} else {
+				t->rrd_filename_tmpl = compile_macros(
+				    &cur_config.pool, t->rrd_filename);
 			}
 			if (!t->force_down) {
 				t->force_down = 0;
 			}
+			if (!t->depends_on) {
+				t->depends_on = cur_config.target_defaults.depends_on;
+			}
+			if (t->size <= 0) {
+				t->size = cur_config.target_defaults.size;
+			}
+			if (t->size > PROBE_SIZE_MAX) {
+				logit("Probe size of target %s cut to %i bytes",
+				    t->name, PROBE_SIZE_MAX);
+				t->size = PROBE_SIZE_MAX;
+			}
+			if (t->tos < 0) {
+				t->tos = cur_config.target_defaults.tos;
+			}
+			if (t->tos < 0 || t->tos > 255) {
+				logit("TOS of target %s out of range, using 0",
+				    t->name);
+				t->tos = 0;
+			}
+			if (t->df < 0) {
+				t->df = cur_config.target_defaults.df;
+			}
 
 			for (al = t->alarms; al && al->next; al = al->next)
 				/* empty */;
@@ -259,21 +728,22 @@ load_config(const char *filename)
 			}
 		}
 
-		if (config) {
-			struct pool_item *pool;
-
-			if (configure_targets(config)) {
-				logit("No usable targets found, exiting");
-				exit(1);
-			}
+		ret = index_alarms(&cur_config);
+	}
 
-			pool = config->pool;
-			pool_clear(&pool);
-			config = NULL;
+	if (ret == 0) {
+		for (t = cur_config.targets; t; t = t->next) {
+			compile_alarms(&cur_config, t);
 		}
+		/* for targets added from the control socket */
+		compile_alarms(&cur_config, &cur_config.target_defaults);
+	}
 
-		config = PNEW(cur_config.pool, struct config, 1);
-		memcpy(config, &cur_config, sizeof(struct config));
+	if (ret == 0) {
+		*cfgp = PNEW(cur_config.pool, struct config, 1);
+		memcpy(*cfgp, &cur_config, sizeof(struct config));
+	} else {
+		pool_clear(&cur_config.pool);
 	}
 
 	memset(&cur_config, 0, sizeof(cur_config));
@@ -281,10 +751,47 @@ load_config(const char *filename)
 	return (ret);
 }
 
+/* make a parsed configuration the active one */
+void
+apply_config(struct config *cfg)
+{
+	struct pool pool;
+
+	if (config == NULL) {
+		config = cfg;
+		return;
+	}
+
+	pool = config->pool;
+	config = cfg;
+
+	if (configure_targets(config)) {
+		logit("No usable targets found, exiting");
+		exit(1);
+	}
+
+	/* nothing refers to the old configuration any more */
+	pool_clear(&pool);
+}
+
+int
+load_config(const char *filename)
+{
+	struct config *cfg;
+	int ret;
+
+	ret = parse_config(filename, &cfg);
+	if (ret == 0) {
+		apply_config(cfg);
+	}
+
+	return (ret);
+}
+
 void
 free_config(void)
 {
-	struct pool_item *pool = config->pool;
+	struct pool pool = config->pool;
 
 	pool_clear(&pool);
 }
@@ -20,25 +20,61 @@
 #ifndef conf_h
 #define conf_h
 
-struct pool_item {
-	struct pool_item *next;
+#include <stdint.h>
+
+/*
+ * Configuration memory is carved from large chunks and released all
+ * at once by pool_clear().  Strings are interned, so repeated values
+ * (srcip, descriptions, commands) are stored once and must not be
+ * modified.
+ */
+struct pool_chunk {
+	struct pool_chunk *next;
+	size_t used;
+	size_t size;
 };
 
-void *pool_malloc(struct pool_item **pool,size_t size);
-char *pool_strdup(struct pool_item **pool,const char *str);
-void pool_free(struct pool_item **pool,void *ptr);
-void pool_clear(struct pool_item **pool);
+struct pool {
+	struct pool_chunk *chunks;	/* head is the one being filled */
+	char **strings;			/* interned strings, open addressing */
+	unsigned int strings_size;
+	unsigned int strings_count;
+};
+
+#define POOL_CHUNK_SIZE	16384
+
+void *pool_malloc(struct pool *pool,size_t size);
+char *pool_strdup(struct pool *pool,const char *str);
+void pool_free(struct pool *pool,void *ptr);
+void pool_clear(struct pool *pool);
 
 #define PNEW(pool,type,size) ((type *)pool_malloc(&pool,sizeof(type)*size))
 
+#define HASH_INIT	2166136261U
+
+unsigned int hash_string(unsigned int h, const char *str);
+
 enum alarm_type {
 	AL_NONE=-1,
 	AL_DOWN=0,
 	AL_DELAY,
 	AL_LOSS,
+	AL_UNREACH,
 	NR_ALARMS
 };
 
+/* a macro template, compiled once when the configuration is loaded */
+struct macro_token {
+	int macro;		/* macro character, 0 for literal text */
+	int len;		/* length of the literal text */
+	const char *text;	/* literal text, not terminated */
+};
+
+struct macro_template {
+	int ntokens;
+	struct macro_token tokens[];
+};
+
 struct alarm_cfg {
 	enum alarm_type type;
 	char *name;
@@ -50,9 +86,16 @@ struct alarm_cfg {
 	char *command_off;
 	char *pipe_on;
 	char *pipe_off;
+	struct macro_template *command_on_tmpl;
+	struct macro_template *command_off_tmpl;
+	struct macro_template *pipe_on_tmpl;
+	struct macro_template *pipe_off_tmpl;
 	int combine_interval;
 	int repeat_interval;
 	int repeat_max;
+	int need;		/* delay/loss: change state when "need" of */
+	int window;		/* the last "window" replies agree */
+	int hold;		/* delay/loss: least time between changes */
 	union {
 		int val;
 		struct {
@@ -60,7 +103,9 @@ struct alarm_cfg {
 			int high;
 		}lh;
 	}p;
+	int id;				/* dense index, bit in t->alarms_on */
 	struct alarm_cfg *next;
+	struct alarm_cfg *hnext;	/* alarm_hash chain */
 };
 
 struct alarm_list {
@@ -68,37 +113,94 @@ struct alarm_list {
 	struct alarm_list *next;
 };
 
+struct string_list {
+	char *str;
+	struct string_list *next;
+};
+
+#define TARGET_NAME_MAX	64	/* longest textual address incl. scope */
+#define TARGET_RANGE_MAX 65536	/* most addresses one range may expand to */
+#define TRAIN_MAX	64	/* longest probe train */
+#define CALIBRATE_SAMPLES_MAX 64 /* calibration replies kept */
+#define ALARMS_MAX	64	/* alarm definitions, one bit each */
+#define WINDOW_MAX	64	/* longest alarm sample window */
+#define PROBE_SIZE_MAX	65507	/* largest echo payload */
+
+/* one alarm of a target, compiled for evaluation on every reply */
+struct alarm_eval {
+	struct alarm_cfg *alarm;
+	uint64_t bit;		/* 1 << alarm->id */
+	enum alarm_type type;
+	double low;		/* delay (ms) or loss (%) thresholds */
+	double high;
+	uint64_t window_mask;	/* one bit per sample of the window */
+	int need;		/* samples past a threshold to change state */
+	int hold;		/* least time between changes, ms */
+};
+
 struct target_cfg {
-	char *name;
+	char *name;		/* address, first address of a list or
+				   CIDR prefix of a range */
+	struct string_list *addresses; /* all addresses of a target list */
+	int range;		/* name is a "target range" prefix */
 	char *description;
-	char *srcip;
+	char *srcip;		/* NULL: each address is its own */
+	char *depends_on;	/* address of the parent target */
 	int force_down;
 	int interval;
+	int max_interval;	/* adaptive mode: back off up to this */
+	int fast_interval;	/* adaptive mode: interval while unhealthy */
+	int jitter;		/* random delay added to each probe */
+	int train;		/* probes sent back-to-back per interval */
+	int size;		/* echo payload bytes, 0 for the minimum */
+	int tos;		/* IPv4 TOS or IPv6 traffic class, -1 unset */
+	int df;			/* don't fragment, -1 for the system default */
+	int calibration;	/* the built-in loopback calibration target */
 	int avg_delay_samples;
 	int avg_loss_delay_samples;
 	int avg_loss_samples;
 	char *rrd_filename;
+	struct macro_template *rrd_filename_tmpl;
 
 	struct alarm_list *alarms;
 	int alarms_override;
+	struct alarm_eval *alarm_tab;	/* alarms, without duplicates */
+	int nalarm_tab;
+	uint64_t down_mask;	/* bits of its down alarms */
+	int down_time;		/* shortest down alarm time, 0 if none */
 	struct target_cfg *next;
 };
 
 struct config {
-	struct pool_item *pool;
+	struct pool pool;
 	struct alarm_cfg *alarms;
+	struct alarm_cfg **alarm_hash;	/* alarms by (type, name) */
+	unsigned int alarm_hash_size;
+	int nalarms;		/* alarm ids are 0..nalarms-1 */
 	struct target_cfg *targets;
 	struct alarm_cfg alarm_defaults;
 	struct target_cfg target_defaults;
 	int rrd_interval;
+	int max_pps;		/* global probe rate limit, 0 if none */
+	int calibrate;		/* probe loopback to measure own latency */
+	int calibrate_interval;
+	int calibrate_samples;
 	int debug;
 	char *user;
 	char *group;
 	char *mailer;
 	char *pid_file;
 	char *status_file;
+	char *status_self_file;
 	int status_interval;
 	char *timestamp_format;
+	char *metrics_listen;
+	char *control_socket;
+	int sim_delay;		/* simulated network (-s), times in ms */
+	int sim_jitter;
+	int sim_loss;		/* percent */
+	int sim_reorder;	/* percent */
+	int sim_duration;	/* virtual run time, 0 for no limit */
 };
 
 extern struct config cur_config,default_config;
@@ -111,7 +213,28 @@ struct target_cfg * make_target();
 void add_alarm(enum alarm_type type);
 void add_target(void);
 struct alarm_list *alarm2list(const char *aname,struct alarm_list *list);
+struct string_list *string2list(const char *str, struct string_list *list);
+struct string_list *reverse_list(struct string_list *list);
+struct macro_template *compile_macros(struct pool *pool, const char *str);
+struct alarm_cfg *find_alarm(struct config *cfg, enum alarm_type type,
+    const char *name);
+
+/* walks the addresses a target definition expands to */
+struct target_iter {
+	struct target_cfg *tc;
+	struct string_list *list;
+	unsigned long pos;
+	unsigned long end;
+	int family;
+	unsigned char base[16];
+	char name[TARGET_NAME_MAX];
+};
+
+void target_iter_init(struct target_iter *it, struct target_cfg *tc);
+int target_iter_next(struct target_iter *it);
 
+int parse_config(const char *filename, struct config **cfgp);
+void apply_config(struct config *cfg);
 int load_config(const char *filename);
 int configure_targets(struct config *);
 void free_config(void);
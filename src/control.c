@@ -0,0 +1,598 @@
+/*
+ *  Alarm Pinger (c) 2002 Jacek Konieczny <jajcus@jajcus.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ */
+
+/*
+ * Line based control protocol on a Unix socket, served from the main loop.
+ * Every command is answered with zero or more data lines followed by
+ * either "OK" or "ERROR <reason>".
+ */
+
+#include "config.h"
+#include "apinger.h"
+#include "control.h"
+#include "debug.h"
+#include "rrd.h"
+
+#include <stdio.h>
+#ifdef HAVE_STDLIB_H
+# include <stdlib.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STDARG_H
+# include <stdarg.h>
+#endif
+#ifdef HAVE_ERRNO_H
+# include <errno.h>
+#endif
+#ifdef HAVE_SYS_POLL_H
+# include <sys/poll.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL	0
+#endif
+
+#define CONTROL_MAX_CLIENTS	8
+#define CONTROL_MAX_ARGS	4
+
+struct control_client {
+	int fd;
+	char in[512];
+	size_t inlen;
+	char *out;
+	size_t outlen;
+	size_t outsize;
+	size_t outoff;
+	int quit;
+};
+
+static struct control_client clients[CONTROL_MAX_CLIENTS];
+static int nclients = 0;
+
+static int listen_fd = -1;
+static char *listen_path = NULL;
+
+static void
+out_reserve(struct control_client *cl, size_t len)
+{
+	if (cl->outlen + len <= cl->outsize) {
+		return;
+	}
+	if (cl->outsize == 0) {
+		cl->outsize = 256;
+	}
+	while (cl->outsize < cl->outlen + len) {
+		cl->outsize *= 2;
+	}
+	cl->out = realloc(cl->out, cl->outsize);
+	if (cl->out == NULL) {
+		logit("Out of memory in control connection");
+		exit(1);
+	}
+}
+
+static void
+out_printf(struct control_client *cl, const char *format, ...)
+{
+	va_list args;
+	int n;
+
+	va_start(args, format);
+	n = vsnprintf(NULL, 0, format, args);
+	va_end(args);
+	if (n < 0) {
+		return;
+	}
+
+	out_reserve(cl, n + 1);
+
+	va_start(args, format);
+	vsnprintf(cl->out + cl->outlen, n + 1, format, args);
+	va_end(args);
+	cl->outlen += n;
+}
+
+static void
+out_status(struct control_client *cl, struct target *t)
+{
+	size_t n;
+
+	n = status_line(NULL, 0, t);
+	out_reserve(cl, n + 2);
+	status_line(cl->out + cl->outlen, n + 1, t);
+	cl->outlen += n;
+	cl->out[cl->outlen++] = '\n';
+}
+
+static int
+target_matches(struct target *t, const char *name, const char *srcip)
+{
+	if (strcmp(t->name, name)) {
+		return (0);
+	}
+	return (srcip == NULL || strcmp(t->srcip, srcip) == 0);
+}
+
+static void
+cmd_stats(struct control_client *cl, int argc, char **argv)
+{
+	struct target *t;
+	int found = 0;
+
+	if (argc < 2) {
+		out_printf(cl, "ERROR usage: stats <target> [<srcip>]\n");
+		return;
+	}
+
+	for (t = targets; t; t = t->next) {
+		if (target_matches(t, argv[1], argc > 2 ? argv[2] : NULL)) {
+			out_status(cl, t);
+			found++;
+		}
+	}
+
+	if (found) {
+		out_printf(cl, "OK\n");
+	} else {
+		out_printf(cl, "ERROR unknown target\n");
+	}
+}
+
+static void
+cmd_alarms(struct control_client *cl, int argc, char **argv)
+{
+	struct alarm_eval *e;
+	struct target *t;
+	int i;
+
+	(void)argc;
+	(void)argv;
+
+	for (t = targets; t; t = t->next) {
+		for (i = 0; t->alarms_on && i < t->config->nalarm_tab; i++) {
+			e = &t->config->alarm_tab[i];
+			if (t->alarms_on & e->bit) {
+				out_printf(cl, "%s|%s|%s|%s|%s\n", t->name,
+				    t->srcip, t->description,
+				    e->alarm->name, (t->suppressed & e->bit) ?
+				    "suppressed" : "reported");
+			}
+		}
+	}
+
+	out_printf(cl, "OK\n");
+}
+
+static void
+cmd_probe(struct control_client *cl, int argc, char **argv)
+{
+	struct target *t;
+	int found = 0;
+
+	if (argc < 2) {
+		out_printf(cl, "ERROR usage: probe <target> [<srcip>]\n");
+		return;
+	}
+
+	for (t = targets; t; t = t->next) {
+		if (target_matches(t, argv[1], argc > 2 ? argv[2] : NULL)) {
+			send_probe(t);
+			found++;
+		}
+	}
+
+	if (found) {
+		out_printf(cl, "OK\n");
+	} else {
+		out_printf(cl, "ERROR unknown target\n");
+	}
+}
+
+static void
+unlink_target_cfg(struct target_cfg *tc)
+{
+	struct target_cfg **tp;
+
+	for (tp = &config->targets; *tp; tp = &(*tp)->next) {
+		if (*tp == tc) {
+			*tp = tc->next;
+			return;
+		}
+	}
+}
+
+static void
+cmd_add(struct control_client *cl, int argc, char **argv)
+{
+	struct target_cfg *tc;
+	struct target *t;
+	const char *srcip;
+
+	if (argc < 2) {
+		out_printf(cl, "ERROR usage: add <target> [<srcip>]\n");
+		return;
+	}
+
+	if (argc > 2) {
+		srcip = argv[2];
+	} else if (config->target_defaults.srcip &&
+	    config->target_defaults.srcip[0]) {
+		srcip = config->target_defaults.srcip;
+	} else {
+		srcip = argv[1];
+	}
+
+	if (find_target(argv[1], srcip)) {
+		out_printf(cl, "ERROR target exists\n");
+		return;
+	}
+
+	tc = PNEW(config->pool, struct target_cfg, 1);
+	*tc = config->target_defaults;
+	tc->name = pool_strdup(&config->pool, argv[1]);
+	tc->srcip = pool_strdup(&config->pool, srcip);
+	tc->next = config->targets;
+	config->targets = tc;
+
+	t = new_target(tc, tc->name);
+	if (t == NULL) {
+		unlink_target_cfg(tc);
+		out_printf(cl, "ERROR bad address\n");
+		return;
+	}
+	link_target(t);
+
+	if (config->rrd_interval && tc->rrd_filename) {
+		rrd_create();
+	}
+
+	logit("Target %s added from control socket", tc->name);
+	out_printf(cl, "OK\n");
+}
+
+static void
+cmd_remove(struct control_client *cl, int argc, char **argv)
+{
+	struct target *t, *nt;
+	struct target_cfg *tc;
+	int found = 0;
+
+	if (argc < 2) {
+		out_printf(cl, "ERROR usage: remove <target> [<srcip>]\n");
+		return;
+	}
+
+	for (t = targets; t; t = nt) {
+		nt = t->next;
+		if (!target_matches(t, argv[1], argc > 2 ? argv[2] : NULL)) {
+			continue;
+		}
+		tc = t->config;
+		delete_target(t);
+		/* ranges and lists may still cover other targets */
+		if (!tc->range && !tc->addresses) {
+			unlink_target_cfg(tc);
+		}
+		found++;
+	}
+
+	if (found) {
+		logit("Target %s removed from control socket", argv[1]);
+		out_printf(cl, "OK\n");
+	} else {
+		out_printf(cl, "ERROR unknown target\n");
+	}
+}
+
+static void
+cmd_help(struct control_client *cl, int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	out_printf(cl,
+	    "stats <target> [<srcip>]\n"
+	    "alarms\n"
+	    "probe <target> [<srcip>]\n"
+	    "add <target> [<srcip>]\n"
+	    "remove <target> [<srcip>]\n"
+	    "quit\n"
+	    "OK\n");
+}
+
+static void
+cmd_quit(struct control_client *cl, int argc, char **argv)
+{
+	(void)argc;
+	(void)argv;
+
+	out_printf(cl, "OK\n");
+	cl->quit = 1;
+}
+
+static const struct {
+	const char *name;
+	void (*handler)(struct control_client *, int, char **);
+} commands[] = {
+	{ "stats", cmd_stats },
+	{ "alarms", cmd_alarms },
+	{ "probe", cmd_probe },
+	{ "add", cmd_add },
+	{ "remove", cmd_remove },
+	{ "help", cmd_help },
+	{ "quit", cmd_quit },
+	{ NULL, NULL }
+};
+
+static void
+control_command(struct control_client *cl, char *line)
+{
+	char *argv[CONTROL_MAX_ARGS];
+	int argc = 0;
+	char *p;
+	int i;
+
+	for (p = strtok(line, " \t\r"); p && argc < CONTROL_MAX_ARGS;
+	    p = strtok(NULL, " \t\r")) {
+		argv[argc++] = p;
+	}
+	if (argc == 0) {
+		return;
+	}
+
+	debug("Control command: %s", argv[0]);
+
+	for (i = 0; commands[i].name; i++) {
+		if (strcmp(commands[i].name, argv[0]) == 0) {
+			commands[i].handler(cl, argc, argv);
+			return;
+		}
+	}
+
+	out_printf(cl, "ERROR unknown command\n");
+}
+
+static void
+client_close(struct control_client *cl)
+{
+	close(cl->fd);
+	cl->fd = -1;
+	free(cl->out);
+	cl->out = NULL;
+	cl->outlen = cl->outsize = cl->outoff = 0;
+}
+
+static void
+client_read(struct control_client *cl)
+{
+	char *nl, *line;
+	ssize_t n;
+
+	n = recv(cl->fd, cl->in + cl->inlen, sizeof(cl->in) - cl->inlen - 1,
+	    MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (n <= 0) {
+		client_close(cl);
+		return;
+	}
+	cl->inlen += n;
+	cl->in[cl->inlen] = '\0';
+
+	line = cl->in;
+	while (!cl->quit && (nl = strchr(line, '\n')) != NULL) {
+		*nl = '\0';
+		control_command(cl, line);
+		line = nl + 1;
+	}
+
+	cl->inlen -= line - cl->in;
+	memmove(cl->in, line, cl->inlen);
+
+	if (cl->inlen == sizeof(cl->in) - 1) {
+		out_printf(cl, "ERROR line too long\n");
+		cl->quit = 1;
+	}
+}
+
+static void
+client_write(struct control_client *cl)
+{
+	ssize_t n;
+
+	if (cl->outoff < cl->outlen) {
+		n = send(cl->fd, cl->out + cl->outoff, cl->outlen - cl->outoff,
+		    MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno != EAGAIN && errno != EINTR) {
+				client_close(cl);
+			}
+			return;
+		}
+		cl->outoff += n;
+	}
+
+	if (cl->outoff == cl->outlen) {
+		cl->outoff = cl->outlen = 0;
+		if (cl->quit) {
+			client_close(cl);
+		}
+	}
+}
+
+int
+control_pollfds(struct pollfd *pfd, int max)
+{
+	int i, n = 0;
+
+	if (listen_fd < 0 || max < 1) {
+		return (0);
+	}
+
+	pfd[n].fd = listen_fd;
+	pfd[n].events = POLLIN;
+	pfd[n++].revents = 0;
+
+	for (i = 0; i < nclients && n < max; i++) {
+		pfd[n].fd = clients[i].fd;
+		pfd[n].events = clients[i].outlen ? POLLOUT : POLLIN;
+		pfd[n++].revents = 0;
+	}
+
+	return (n);
+}
+
+void
+control_process(struct pollfd *pfd, int n)
+{
+	struct control_client *cl;
+	int fd, i, j;
+
+	if (listen_fd < 0 || n < 1) {
+		return;
+	}
+
+	/* pfd[1..] were filled from clients[] in the same order */
+	for (i = 1; i < n && i - 1 < nclients; i++) {
+		cl = &clients[i - 1];
+		if (cl->fd < 0 || pfd[i].fd != cl->fd || !pfd[i].revents) {
+			continue;
+		}
+		if (pfd[i].revents & (POLLERR | POLLNVAL)) {
+			client_close(cl);
+			continue;
+		}
+		if (pfd[i].revents & (POLLIN | POLLHUP)) {
+			client_read(cl);
+		}
+		if (cl->fd >= 0 && cl->outlen) {
+			client_write(cl);
+		}
+	}
+
+	for (i = j = 0; i < nclients; i++) {
+		if (clients[i].fd >= 0) {
+			clients[j++] = clients[i];
+		}
+	}
+	nclients = j;
+
+	if (!(pfd[0].revents & POLLIN)) {
+		return;
+	}
+
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		if (nclients >= CONTROL_MAX_CLIENTS) {
+			debug("Too many control clients, dropping connection");
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		cl = &clients[nclients++];
+		memset(cl, 0, sizeof(*cl));
+		cl->fd = fd;
+	}
+}
+
+void
+control_init(void)
+{
+	const char *path = config->control_socket;
+	struct sockaddr_un sun;
+	mode_t mask;
+	int fd;
+	int r;
+
+	if (listen_path && path && strcmp(listen_path, path) == 0) {
+		return;
+	}
+
+	control_close();
+
+	if (path == NULL) {
+		return;
+	}
+
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sun.sun_path)) {
+		logit("Control socket path too long: %s", path);
+		return;
+	}
+	strcpy(sun.sun_path, path);
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0) {
+		myperror("socket()");
+		return;
+	}
+	/* the socket can add and remove targets: owner and group only */
+	mask = umask(0117);
+	r = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+	umask(mask);
+	if (r < 0) {
+		logit("Could not bind control socket %s", path);
+		myperror("bind()");
+		close(fd);
+		return;
+	}
+	if (listen(fd, CONTROL_MAX_CLIENTS) < 0) {
+		myperror("listen()");
+		close(fd);
+		unlink(path);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	listen_fd = fd;
+	listen_path = strdup(path);
+	debug("Listening for control connections on %s", path);
+}
+
+void
+control_close(void)
+{
+	int i;
+
+	for (i = 0; i < nclients; i++) {
+		client_close(&clients[i]);
+	}
+	nclients = 0;
+
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		listen_fd = -1;
+	}
+	if (listen_path) {
+		unlink(listen_path);
+		free(listen_path);
+		listen_path = NULL;
+	}
+}
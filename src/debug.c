@@ -46,7 +46,7 @@ logit(const char *format, ...)
 
 	if (foreground){
 		time_t t = time(NULL);
-		static char buf[100];
+		char buf[100];
 
 		strftime(buf, sizeof(buf), "%b %d %H:%M:%S", localtime(&t));
 		fprintf(stderr, "[%s] ", buf);
@@ -72,7 +72,7 @@ debug(const char *format, ...)
 
 	if (foreground){
 		time_t t = time(NULL);
-		static char buf[100];
+		char buf[100];
 
 		strftime(buf, sizeof(buf), "%b %d %H:%M:%S", localtime(&t));
 		fprintf(stderr, "[%s] ", buf);
@@ -56,68 +56,144 @@
 #ifdef HAVE_SYS_UIO_H
 # include <sys/uio.h>
 #endif
+#ifdef HAVE_ASSERT_H
+# include <assert.h>
+#endif
 #include "debug.h"
 
-/* function borrowed from iputils */
-u_short in_cksum(const u_short *addr, register int len, u_short csum){
-
-	register int nleft = len;
-        const u_short *w = addr;
-        register u_short answer;
-        register int sum = csum;
-
-        /*
-         *  Our algorithm is simple, using a 32 bit accumulator (sum),
-         *  we add sequential 16 bit words to it, and at the end, fold
-         *  back all the carry bits from the top 16 bits into the lower
-         *  16 bits.
-         */
-        while (nleft > 1)  {
-                sum += *w++;
-                nleft -= 2;
-        }
-
-        /* mop up an odd byte, if necessary */
-        if (nleft == 1)
-                sum += htons(*(u_char *)w << 8);
-
-        /*
-         * add back carry outs from top 16 bits to low 16 bits
-         */
-        sum = (sum >> 16) + (sum & 0xffff);     /* add hi 16 to low 16 */
-        sum += (sum >> 16);                     /* add carry */
-        answer = ~sum;                          /* truncate to 16 bits */
-        return (answer);
+/*
+ * One's complement sum of len bytes added to "sum", folded to 16 bits
+ * (RFC 1071). 16 bytes are loaded per iteration and their 32 bit halves
+ * added to two independent 64 bit accumulators, which cannot overflow
+ * for any packet, so there is no carry handling in the loop. Folding
+ * gives the same result as adding 16 bit words.
+ */
+static uint32_t
+cksum_add(const void *buf, int len, uint32_t sum)
+{
+	const unsigned char *p = buf;
+	uint64_t acc = sum, acc2 = 0, w, w2;
+	uint32_t v;
+
+	for (; len >= 16; p += 16, len -= 16) {
+		memcpy(&w, p, 8);
+		memcpy(&w2, p + 8, 8);
+		acc += (w & 0xffffffff) + (w >> 32);
+		acc2 += (w2 & 0xffffffff) + (w2 >> 32);
+	}
+	acc += acc2;
+	for (; len >= 4; p += 4, len -= 4) {
+		memcpy(&v, p, 4);
+		acc += v;
+	}
+	/* the last bytes, padded with zeros like an odd byte */
+	if (len > 0) {
+		v = 0;
+		memcpy(&v, p, len);
+		acc += v;
+	}
+
+	acc = (acc >> 32) + (acc & 0xffffffff);
+	acc = (acc >> 32) + (acc & 0xffffffff);
+	acc = (acc >> 16) + (acc & 0xffff);
+	acc = (acc >> 16) + (acc & 0xffff);
+	return ((uint32_t)acc);
 }
 
-void send_icmp_probe(struct target *t,int seq){
-static char buf[1024];
-struct icmp *p=(struct icmp *)buf;
-struct trace_info ti;
-struct timeval cur_time;
-int size;
-int ret;
+u_short
+in_cksum(const u_short *addr, int len, u_short csum)
+{
+	return ((u_short)~cksum_add(addr, len, csum));
+}
 
+/*
+ * Build the echo request of a target, only the sequence number, trace
+ * info and checksum change from probe to probe, and apply its TOS and
+ * don't fragment settings to the socket.
+ */
+void
+setup_icmp_probe(struct target *t)
+{
+	struct target_cfg *tc = t->config;
+	struct icmp *p;
+	int i, len, opt;
 
-	p->icmp_type=ICMP_ECHO;
-	p->icmp_code=0;
-	p->icmp_cksum=0;
-	p->icmp_seq=seq%65536;
-	p->icmp_id=ident;
+	len = tc->size > (int)sizeof(struct trace_info) ? tc->size :
+	    (int)sizeof(struct trace_info);
+	len += ICMP_MINLEN;
+	if (len != t->probe_len) {
+		free(t->probe);
+		t->probe = NEW(unsigned char, len);
+		assert(t->probe != NULL);
+		t->probe_len = len;
+	}
+	p = (struct icmp *)t->probe;
+	p->icmp_type = ICMP_ECHO;
+	p->icmp_code = 0;
+	p->icmp_cksum = 0;
+	p->icmp_id = ident;
+	p->icmp_seq = 0;
+	memset(t->probe + ICMP_MINLEN, 0, sizeof(struct trace_info));
+	/* recognizable padding, as ping(8) sends */
+	for (i = ICMP_MINLEN + sizeof(struct trace_info); i < len; i++) {
+		t->probe[i] = i & 0xff;
+	}
+	/* what does not change, see fill_icmp_probe() */
+	t->probe_sum = cksum_add(t->probe, len, 0);
+
+	if (t->socket <= 0) {
+		return;
+	}
+	opt = tc->tos;
+	if (setsockopt(t->socket, IPPROTO_IP, IP_TOS, &opt, sizeof(opt))) {
+		myperror("setsockopt(IP_TOS)");
+	}
+#if defined(IP_MTU_DISCOVER)
+	opt = tc->df < 0 ? IP_PMTUDISC_WANT :
+	    tc->df ? IP_PMTUDISC_DO : IP_PMTUDISC_DONT;
+	if (setsockopt(t->socket, IPPROTO_IP, IP_MTU_DISCOVER, &opt,
+	    sizeof(opt))) {
+		myperror("setsockopt(IP_MTU_DISCOVER)");
+	}
+#elif defined(IP_DONTFRAG)
+	if (tc->df >= 0) {
+		opt = tc->df;
+		if (setsockopt(t->socket, IPPROTO_IP, IP_DONTFRAG, &opt,
+		    sizeof(opt))) {
+			myperror("setsockopt(IP_DONTFRAG)");
+		}
+	}
+#endif
+}
+
+/*
+ * Patch the sequence number and trace info into the template. They
+ * were zero when the sum of the rest was taken, so the checksum is that
+ * sum plus the new words (RFC 1624, eqn. 3, with m = 0) and the
+ * padding is never summed again.
+ */
+void
+fill_icmp_probe(struct target *t, int seq)
+{
+	struct icmp *p = (struct icmp *)t->probe;
+	struct trace_info ti;
+
+	p->icmp_seq = seq & 0xffff;
+	make_trace_info(&ti, t, seq);
+	memcpy(t->probe + ICMP_MINLEN, &ti, sizeof(ti));
+	p->icmp_cksum = ~cksum_add(&ti, sizeof(ti),
+	    t->probe_sum + p->icmp_seq);
+}
+
+void send_icmp_probe(struct target *t,int seq){
+int ret;
 
 #ifdef HAVE_SCHED_YIELD
 	/* Give away our time now, or we may be stopped between apinger_gettime() and sendto() */
 	sched_yield();
 #endif
-	apinger_gettime(&cur_time);
-	ti.timestamp=cur_time;
-	ti.target_id=t;
-	ti.seq=seq;
-	memcpy(p+1,&ti,sizeof(ti));
-	size=sizeof(*p)+sizeof(ti);
-
-	p->icmp_cksum = in_cksum((u_short *)p,size,0);
-	ret=sendto(t->socket,p,size,MSG_DONTWAIT,
+	fill_icmp_probe(t,seq);
+	ret=sendto(t->socket,t->probe,t->probe_len,MSG_DONTWAIT,
 			(struct sockaddr *)&t->addr.addr4,sizeof(t->addr.addr4));
 	if (ret<0){
 		if (config->debug) myperror("sendto");
@@ -127,22 +203,61 @@ int ret;
 			if (t->socket)
 				close(t->socket);
 			make_icmp_socket(t);
+			setup_icmp_probe(t);
 			break;
 		}
 	}
 }
 
-void recv_icmp(struct target *t, struct timeval *time_recv, int timedelta){
+/* match an ICMP error to our probe by the quoted header */
+static void
+recv_icmp_error(struct target *t, struct icmp *icmp, int icmplen)
+{
+	struct icmp *orig;
+	struct ip *ip;
+	int hlen;
+
+	if (icmplen < ICMP_MINLEN + (int)sizeof(struct ip)) {
+		return;
+	}
+	ip = &icmp->icmp_ip;
+	hlen = ip->ip_hl * 4;
+	if (ip->ip_hl < 5 || icmplen < ICMP_MINLEN + hlen + ICMP_MINLEN) {
+		return;
+	}
+	/*
+	 * Only the target's own socket takes it, as for replies; targets
+	 * sharing the address are told apart by the source of the probe.
+	 */
+	if (ip->ip_p != IPPROTO_ICMP ||
+	    ip->ip_dst.s_addr != t->addr.addr4.sin_addr.s_addr) {
+		return;
+	}
+	if (t->ifaddr.addr4.sin_addr.s_addr != INADDR_ANY &&
+	    ip->ip_src.s_addr != t->ifaddr.addr4.sin_addr.s_addr) {
+		return;
+	}
+	orig = (struct icmp *)((char *)ip + hlen);
+	if (orig->icmp_type != ICMP_ECHO || orig->icmp_id != ident) {
+		return;
+	}
+
+	analyze_error(t, orig->icmp_seq, icmp->icmp_type == ICMP_UNREACH ?
+	    ICMP_ERR_UNREACH : ICMP_ERR_TIMXCEED);
+}
+
+void recv_icmp(struct target *t, nstime_t time_recv, nstime_t timedelta){
 int len,hlen,icmplen,datalen;
-char buf[1024];
+static char buf[65536];	/* largest IPv4 packet */
 struct sockaddr_in from;
 struct icmp *icmp;
 struct ip *ip;
+struct trace_info ti;
 socklen_t sl;
 reloophack:
 
 	sl=sizeof(from);
-	len=recvfrom(t->socket,buf,1024,MSG_DONTWAIT,(struct sockaddr *)&from,&sl);
+	len=recvfrom(t->socket,buf,sizeof(buf),MSG_DONTWAIT,(struct sockaddr *)&from,&sl);
 	if (len<0){
 		if (errno==EAGAIN) return;
 		myperror("recvfrom");
@@ -157,6 +272,10 @@ reloophack:
 	}
 	icmplen=len-hlen;
 	icmp=(struct icmp *)(buf+hlen);
+	if (icmp->icmp_type == ICMP_UNREACH || icmp->icmp_type == ICMP_TIMXCEED){
+		recv_icmp_error(t,icmp,icmplen);
+		goto reloophack;
+	}
 	if (icmp->icmp_type != ICMP_ECHOREPLY){
 		debug("Other (%i) icmp type received",icmp->icmp_type);
 		return;
@@ -166,15 +285,21 @@ reloophack:
 		goto reloophack;
 		return;
 	}
+	if (from.sin_addr.s_addr != t->addr.addr4.sin_addr.s_addr){
+		/* every raw socket sees all replies, the target's own takes it */
+		goto reloophack;
+	}
 
 	debug("Ping reply from %s",inet_ntoa(from.sin_addr));
 
-	datalen=icmplen-sizeof(*icmp);
-	if (datalen!=sizeof(struct trace_info)){
+	datalen=icmplen-ICMP_MINLEN;
+	if (datalen<(int)sizeof(ti)){
 		debug("Packet data truncated.");
 		return;
 	}
-	analyze_reply(time_recv,icmp->icmp_seq,(struct trace_info*)(icmp+1), timedelta);
+	/* the IP header leaves it unaligned */
+	memcpy(&ti,(char *)icmp+ICMP_MINLEN,sizeof(ti));
+	analyze_reply(time_recv,icmp->icmp_seq,&ti,timedelta);
 }
 
 int
@@ -184,13 +309,13 @@ make_icmp_socket(struct target *t)
 	if (t->socket < 0) {
 		logit("Could not create socket on address (%s) "
 		    "for monitoring address %s (%s)",
-		    t->config->srcip, t->name, t->description);
+		    t->srcip, t->name, t->description);
 		myperror("socket()");
 	} else if (bind(t->socket, (struct sockaddr *)&t->ifaddr.addr4,
 	    sizeof(t->ifaddr.addr4)) < 0) {
 		logit("Could not bind socket on address (%s) "
 		    "for monitoring address %s (%s)",
-		    t->config->srcip, t->name, t->description);
+		    t->srcip, t->name, t->description);
 		myperror("bind()");
 	}
 
@@ -55,34 +55,70 @@
 #ifdef HAVE_SYS_UIO_H
 # include <sys/uio.h>
 #endif
+#ifdef HAVE_ASSERT_H
+# include <assert.h>
+#endif
 #include "debug.h"
 
+/* as setup_icmp_probe(), the kernel computes ICMPv6 checksums */
+void
+setup_icmp6_probe(struct target *t)
+{
+	struct target_cfg *tc = t->config;
+	struct icmp6_hdr *p;
+	int i, len, opt;
+
+	len = tc->size > (int)sizeof(struct trace_info) ? tc->size :
+	    (int)sizeof(struct trace_info);
+	len += sizeof(*p);
+	if (len != t->probe_len) {
+		free(t->probe);
+		t->probe = NEW(unsigned char, len);
+		assert(t->probe != NULL);
+		t->probe_len = len;
+	}
+	p = (struct icmp6_hdr *)t->probe;
+	p->icmp6_type = ICMP6_ECHO_REQUEST;
+	p->icmp6_code = 0;
+	p->icmp6_id = ident;
+	for (i = sizeof(*p) + sizeof(struct trace_info); i < len; i++) {
+		t->probe[i] = i & 0xff;
+	}
+
+	if (t->socket <= 0) {
+		return;
+	}
+#ifdef IPV6_TCLASS
+	opt = tc->tos;
+	if (setsockopt(t->socket, IPPROTO_IPV6, IPV6_TCLASS, &opt,
+	    sizeof(opt))) {
+		myperror("setsockopt(IPV6_TCLASS)");
+	}
+#endif
+#ifdef IPV6_DONTFRAG
+	opt = tc->df > 0;
+	if (setsockopt(t->socket, IPPROTO_IPV6, IPV6_DONTFRAG, &opt,
+	    sizeof(opt))) {
+		myperror("setsockopt(IPV6_DONTFRAG)");
+	}
+#endif
+}
+
 void send_icmp6_probe(struct target *t,int seq){
-static char buf[1024];
-struct icmp6_hdr *p=(struct icmp6_hdr *)buf;
+struct icmp6_hdr *p=(struct icmp6_hdr *)t->probe;
 struct trace_info ti;
-struct timeval cur_time;
-int size;
 int ret;
 
-	p->icmp6_type=ICMP6_ECHO_REQUEST;
-	p->icmp6_code=0;
-	p->icmp6_cksum=0;
-	p->icmp6_seq=seq%65536;
-	p->icmp6_id=ident;
+	p->icmp6_seq=seq&0xffff;
 
 #ifdef HAVE_SCHED_YIELD
 	/* Give away our time now, or we may be stopped between apinger_gettime() and sendto() */
 	sched_yield();
 #endif
-	apinger_gettime(&cur_time);
-	ti.timestamp=cur_time;
-	ti.target_id=t;
-	ti.seq=seq;
+	make_trace_info(&ti,t,seq);
 	memcpy(p+1,&ti,sizeof(ti));
-	size=sizeof(*p)+sizeof(ti);
 
-	ret=sendto(t->socket,p,size,MSG_DONTWAIT,
+	ret=sendto(t->socket,t->probe,t->probe_len,MSG_DONTWAIT,
 			(struct sockaddr *)&t->addr.addr6,sizeof(t->addr.addr6));
 	if (ret<0){
 		if (config->debug) myperror("sendto");
@@ -92,21 +128,55 @@ int ret;
                         if (t->socket)
                                 close(t->socket);
                         make_icmp6_socket(t);
+                        setup_icmp6_probe(t);
                         break;
                 }
 	}
 }
 
-void recv_icmp6(struct target *t, struct timeval *time_recv, int timedelta){
+/* match an ICMPv6 error to our probe by the quoted header */
+static void
+recv_icmp6_error(struct target *t, struct icmp6_hdr *icmp, int icmplen)
+{
+	struct icmp6_hdr *orig;
+	struct ip6_hdr *ip6;
+
+	if (icmplen < (int)(sizeof(*icmp) + sizeof(*ip6) + sizeof(*orig))) {
+		return;
+	}
+	ip6 = (struct ip6_hdr *)(icmp + 1);
+	/* as for IPv4, match the destination and the source of the probe */
+	if (ip6->ip6_nxt != IPPROTO_ICMPV6 ||
+	    memcmp(&ip6->ip6_dst, &t->addr.addr6.sin6_addr,
+	    sizeof(ip6->ip6_dst)) != 0) {
+		return;
+	}
+	if (!IN6_IS_ADDR_UNSPECIFIED(&t->ifaddr.addr6.sin6_addr) &&
+	    memcmp(&ip6->ip6_src, &t->ifaddr.addr6.sin6_addr,
+	    sizeof(ip6->ip6_src)) != 0) {
+		return;
+	}
+	orig = (struct icmp6_hdr *)(ip6 + 1);
+	if (orig->icmp6_type != ICMP6_ECHO_REQUEST || orig->icmp6_id != ident) {
+		return;
+	}
+
+	analyze_error(t, orig->icmp6_seq,
+	    icmp->icmp6_type == ICMP6_DST_UNREACH ?
+	    ICMP_ERR_UNREACH : ICMP_ERR_TIMXCEED);
+}
+
+void recv_icmp6(struct target *t, nstime_t time_recv, nstime_t timedelta){
 int len,icmplen,datalen;
-char buf[1024];
+static char buf[65536];	/* largest ICMPv6 message without jumbograms */
 struct sockaddr_in6 from;
 struct icmp6_hdr *icmp;
+struct trace_info ti;
 socklen_t sl;
 reloophack6:
 
 	sl=sizeof(from);
-	len=recvfrom(t->socket,buf,1024,0,(struct sockaddr *)&from,&sl);
+	len=recvfrom(t->socket,buf,sizeof(buf),MSG_DONTWAIT,(struct sockaddr *)&from,&sl);
 	if (len<0){
 		if (errno==EAGAIN) return;
 		myperror("recvfrom");
@@ -115,12 +185,22 @@ reloophack6:
 	if (len==0) return;
 	icmplen=len;
 	icmp=(struct icmp6_hdr *)buf;
+	if (icmp->icmp6_type == ICMP6_DST_UNREACH ||
+	    icmp->icmp6_type == ICMP6_TIME_EXCEEDED) {
+		recv_icmp6_error(t, icmp, icmplen);
+		goto reloophack6;
+	}
 	if (icmp->icmp6_type != ICMP6_ECHO_REPLY) return;
 	if (icmp->icmp6_id != ident){
 		debug("Alien echo-reply received from xxx. Expected %i, received %i", ident, icmp->icmp6_id);
 		goto reloophack6;
 		return;
 	}
+	if (memcmp(&from.sin6_addr, &t->addr.addr6.sin6_addr,
+	    sizeof(from.sin6_addr)) != 0) {
+		/* every raw socket sees all replies, the target's own takes it */
+		goto reloophack6;
+	}
 
 	{
 		const char *name;
@@ -131,11 +211,12 @@ reloophack6:
 	}
 
 	datalen=icmplen-sizeof(*icmp);
-	if (datalen!=sizeof(struct trace_info)){
+	if (datalen<(int)sizeof(ti)){
 		debug("Packet data truncated.");
 		return;
 	}
-	analyze_reply(time_recv,icmp->icmp6_seq,(struct trace_info*)(icmp+1), timedelta);
+	memcpy(&ti,icmp+1,sizeof(ti));
+	analyze_reply(time_recv,icmp->icmp6_seq,&ti,timedelta);
 }
 
 
@@ -146,7 +227,7 @@ make_icmp6_socket(struct target *t)
 
 	t->socket = socket(AF_INET6, SOCK_RAW, IPPROTO_ICMPV6);
 	if (t->socket < 0) {
-		logit("Could not create socket on address (%s) for monitoring address %s (%s)", t->config->srcip, t->name, t->description);
+		logit("Could not create socket on address (%s) for monitoring address %s (%s)", t->srcip, t->name, t->description);
 		myperror("socket()");
 	} else {
 		opt = 2;
@@ -158,7 +239,7 @@ make_icmp6_socket(struct target *t)
 #endif
 
 		if (bind(t->socket, (struct sockaddr *)&t->ifaddr.addr6, sizeof(t->ifaddr.addr6)) < 0) {
-			logit("Could not bind socket on address(%s) for monitoring address %s(%s) with error %m", t->config->srcip, t->name, t->description);
+			logit("Could not bind socket on address(%s) for monitoring address %s(%s) with error %m", t->srcip, t->name, t->description);
 			myperror("bind()");
 		}
 	}
@@ -185,4 +266,9 @@ send_icmp6_probe(struct target *t, int seq)
 {
 }
 
+void
+setup_icmp6_probe(struct target *t)
+{
+}
+
 #endif /*HAVE_IPV6*/
@@ -43,8 +43,11 @@
 # include <errno.h>
 #endif
 
+#include "backend.h"
 #include "conf.h"
+#include "control.h"
 #include "debug.h"
+#include "metrics.h"
 #include "rrd.h"
 
 struct target *targets = NULL;
@@ -54,6 +57,9 @@ struct config default_config = {
 	.pid_file = "/var/run/apinger.pid",
 	.mailer = "/usr/lib/sendmail -t",
 	.user = "nobody",
+	.calibrate_interval = 1000,
+	.calibrate_samples = 20,
+	.sim_delay = 20,
 	.alarm_defaults = {
 		.mailsubject = "%r: %T(%t) *** %a ***",
 		.mailfrom = "nobody",
@@ -68,6 +74,8 @@ struct config default_config = {
 		.name = "default",
 		.interval = 1000,
 		.srcip = "",
+		.tos = 0,
+		.df = -1,
 	},
 };
 
@@ -76,7 +84,7 @@ char *config_file = CONFIG;
 
 uint16_t ident;
 
-struct timeval next_probe = { 0, 0 };
+nstime_t next_probe = 0;
 
 /* Interrupt handler */
 typedef void (*sighandler_t)(int);
@@ -115,12 +123,13 @@ int pid, status, serrno;
 }
 #endif
 
+#ifndef APINGER_BENCH
 static void
 usage(void)
 {
 	fprintf(stderr,"Alarm Pinger " PACKAGE_VERSION " (c) 2002 Jacek Konieczny <jajcus@jajcus.net>\n");
 	fprintf(stderr,"Usage:\n");
-	fprintf(stderr,"\tapinger [-c <file>] [-f] [-d]\n");
+	fprintf(stderr,"\tapinger [-c <file>] [-f] [-d] [-s]\n");
 	fprintf(stderr,"\tapinger [-c <file>] -g <dir> [-l <location>]\n");
 	fprintf(stderr,"\tapinger -h\n");
 	fprintf(stderr,"\n");
@@ -128,6 +137,7 @@ usage(void)
 	fprintf(stderr,"\t-t\ttest config and exit.\n");
 	fprintf(stderr,"\t-f\trun in foreground.\n");
 	fprintf(stderr,"\t-d\tdebug on.\n");
+	fprintf(stderr,"\t-s\tsimulate the network (see \"simulate\" in the config).\n");
 	fprintf(stderr,"\t-g <dir>\tgenerate simple rrd-cgi script.\n");
 	fprintf(stderr,		"\t\t<dir> is a directory where generated graph will be stored.\n");
 	fprintf(stderr,"\t-l <location>\tHTTP location of generated graphs.\n");
@@ -135,6 +145,18 @@ usage(void)
 	exit(1);
 }
 
+/* hand a Unix socket opened as root over to the daemon's user */
+static void
+chown_socket(const char *path, uid_t uid, gid_t gid)
+{
+	if (path == NULL || path[0] != '/') {
+		return;
+	}
+	if (chown(path, uid, gid) && errno != ENOENT) {
+		myperror("chown()");
+	}
+}
+
 int
 main(int argc, char **argv)
 {
@@ -145,12 +167,13 @@ main(int argc, char **argv)
 	struct passwd *pw;
 	struct group *gr;
 	int do_debug = 0;
+	int simulate = 0;
 	FILE *pidfile;
 	pid_t pid;
 	int i;
 	int c;
 
-	while ((c = getopt(argc,argv,"c:dfg:hl:t")) != -1) {
+	while ((c = getopt(argc,argv,"c:dfg:hl:st")) != -1) {
 		switch (c) {
 		case 'c':
 			config_file = optarg;
@@ -167,6 +190,9 @@ main(int argc, char **argv)
 		case 'l':
 			graph_location = optarg;
 			break;
+		case 's':
+			simulate = 1;
+			break;
 		case 't':
 			config_test = 1;
 			break;
@@ -245,20 +271,41 @@ main(int argc, char **argv)
 		setsid();
 	}
 
-	if (initgroups(pw->pw_name,pw->pw_gid)){
-		myperror("initgroups");
-		return 1;
-	}
-	if (setgid(pw->pw_gid)){
-		myperror("setgid");
-		return 1;
-	}
-	if (setuid(pw->pw_uid)){
-		myperror("setuid");
-		return 1;
+	/*
+	 * Unix sockets usually live where only root may create them, such
+	 * as /var/run, so they are opened before the privileges are dropped.
+	 */
+	metrics_init();
+	control_init();
+
+	/*
+	 * Simulating needs no raw sockets, so an unprivileged user may keep
+	 * running as itself; root drops to "user" as usual.
+	 */
+	if (!simulate || getuid() == 0) {
+		chown_socket(config->metrics_listen, pw->pw_uid,
+		    gr ? gr->gr_gid : pw->pw_gid);
+		chown_socket(config->control_socket, pw->pw_uid,
+		    gr ? gr->gr_gid : pw->pw_gid);
+		if (initgroups(pw->pw_name,pw->pw_gid)){
+			myperror("initgroups");
+			return 1;
+		}
+		if (setgid(pw->pw_gid)){
+			myperror("setgid");
+			return 1;
+		}
+		if (setuid(pw->pw_uid)){
+			myperror("setuid");
+			return 1;
+		}
 	}
 
 	ident=getpid() & 0xFFFF;
+	srandom(time(NULL) ^ getpid());
+	if (simulate) {
+		sim_init();
+	}
 	signal(SIGTERM,signal_handler);
 	signal(SIGINT,signal_handler);
 	signal(SIGHUP,signal_handler);
@@ -291,3 +338,4 @@ main(int argc, char **argv)
 
 	return 0;
 }
+#endif	/* !APINGER_BENCH */
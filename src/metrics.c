@@ -0,0 +1,858 @@
+/*
+ *  Alarm Pinger (c) 2002 Jacek Konieczny <jajcus@jajcus.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ */
+
+/*
+ * Prometheus text exposition served from the main loop.
+ *
+ * Every target keeps its own pre-rendered lines, split per metric family,
+ * which are only re-formatted when the target statistics changed.  A scrape
+ * concatenates those snippets into a shared, reference counted output
+ * buffer, so slow clients never hold up probing and nothing is formatted
+ * twice for an unchanged target.
+ */
+
+#include "config.h"
+#include "apinger.h"
+#include "metrics.h"
+#include "debug.h"
+#include "selfstat.h"
+
+#include <stdio.h>
+#ifdef HAVE_STDLIB_H
+# include <stdlib.h>
+#endif
+#ifdef HAVE_UNISTD_H
+# include <unistd.h>
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_STDARG_H
+# include <stdarg.h>
+#endif
+#ifdef HAVE_ERRNO_H
+# include <errno.h>
+#endif
+#ifdef HAVE_SYS_POLL_H
+# include <sys/poll.h>
+#endif
+#ifdef HAVE_SYS_UIO_H
+# include <sys/uio.h>
+#endif
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#ifndef MSG_NOSIGNAL
+# define MSG_NOSIGNAL	0
+#endif
+
+#define METRICS_MAX_CLIENTS	16
+#define METRICS_TIMEOUT		10	/* seconds */
+
+enum metrics_family {
+	MF_SENT,
+	MF_RECEIVED,
+	MF_LOSS,
+	MF_DELAY,
+	MF_DELAY_RAW,
+	MF_RTT,
+	MF_ALARM,
+	MF_INTERVAL,
+	MF_TRAIN_LOSS,
+	MF_TRAIN_DISPERSION,
+	MF_TRAIN_REORDERED,
+	MF_DUPLICATES,
+	MF_REORDERED,
+	MF_ICMP_ERRORS,
+	NR_FAMILIES
+};
+
+static const struct {
+	const char *name;
+	const char *type;
+	const char *help;
+} families[NR_FAMILIES] = {
+	{ "apinger_probes_sent_total", "counter",
+	    "Echo requests sent to the target." },
+	{ "apinger_probes_received_total", "counter",
+	    "Echo replies received from the target." },
+	{ "apinger_loss_ratio", "gauge",
+	    "Recent average packet loss." },
+	{ "apinger_delay_seconds", "gauge",
+	    "Recent average round trip time." },
+	{ "apinger_delay_raw_seconds", "gauge",
+	    "Recent average round trip time including apinger's own latency." },
+	{ "apinger_rtt_seconds", "histogram",
+	    "Round trip time of all received replies." },
+	{ "apinger_alarm_active", "gauge",
+	    "Alarms currently raised for the target." },
+	{ "apinger_probe_interval_seconds", "gauge",
+	    "Current interval between probes." },
+	{ "apinger_train_loss_ratio", "gauge",
+	    "Packet loss within the last probe train." },
+	{ "apinger_train_dispersion_seconds", "gauge",
+	    "Time between the first and last reply of the last probe train." },
+	{ "apinger_train_reordered", "gauge",
+	    "Reordered replies within the last probe train." },
+	{ "apinger_duplicates_total", "counter",
+	    "Duplicate echo replies dropped." },
+	{ "apinger_reordered_total", "counter",
+	    "Echo replies received after a reply to a later probe." },
+	{ "apinger_icmp_errors_total", "counter",
+	    "ICMP errors received in response to probes." },
+};
+
+/* upper bounds of the delay histogram buckets in milliseconds */
+static const double rtt_bounds[RTT_BUCKETS] = {
+	0.5, 1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000
+};
+
+struct metrics_cache {
+	char *buf;
+	size_t len;
+	size_t size;
+	size_t off[NR_FAMILIES + 1];
+};
+
+struct metrics_buf {
+	int refs;
+	char *data;
+	size_t len;
+	size_t size;
+	size_t base;		/* end of the per-target families */
+};
+
+struct metrics_client {
+	int fd;
+	time_t started;
+	char req[512];
+	size_t reqlen;
+	char hdr[160];
+	size_t hdrlen;
+	struct metrics_buf *out;
+	size_t off;
+};
+
+static struct metrics_client clients[METRICS_MAX_CLIENTS];
+static int nclients = 0;
+
+static struct metrics_buf *current = NULL;
+static int stale = 1;
+
+static int listen_fd = -1;
+static char *listen_spec = NULL;
+
+static void
+grow(char **buf, size_t *size, size_t need)
+{
+	if (need <= *size) {
+		return;
+	}
+	if (*size == 0) {
+		*size = 512;
+	}
+	while (*size < need) {
+		*size *= 2;
+	}
+	*buf = realloc(*buf, *size);
+	if (*buf == NULL) {
+		logit("Out of memory while rendering metrics");
+		exit(1);
+	}
+}
+
+static void
+cache_printf(struct metrics_cache *c, const char *format, ...)
+{
+	va_list args;
+	int n;
+
+	for (;;) {
+		va_start(args, format);
+		n = vsnprintf(c->buf + c->len, c->size - c->len, format, args);
+		va_end(args);
+		if (n < 0) {
+			return;
+		}
+		if ((size_t)n < c->size - c->len) {
+			break;
+		}
+		grow(&c->buf, &c->size, c->len + n + 1);
+	}
+	c->len += n;
+}
+
+static void
+buf_append(struct metrics_buf *b, const char *data, size_t len)
+{
+	grow(&b->data, &b->size, b->len + len);
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static void
+buf_release(struct metrics_buf *b)
+{
+	if (b == NULL || --b->refs > 0) {
+		return;
+	}
+	free(b->data);
+	free(b);
+}
+
+/* label values may contain backslashes, quotes and newlines */
+static void
+escape_label(char *dst, size_t len, const char *src)
+{
+	size_t i = 0;
+
+	for (; src && *src && i + 2 < len; src++) {
+		switch (*src) {
+		case '\\':
+		case '"':
+			dst[i++] = '\\';
+			dst[i++] = *src;
+			break;
+		case '\n':
+			dst[i++] = '\\';
+			dst[i++] = 'n';
+			break;
+		default:
+			dst[i++] = *src;
+			break;
+		}
+	}
+	dst[i] = '\0';
+}
+
+static void
+render_target(struct target *t)
+{
+	char name[128], srcip[128], descr[256], labels[640];
+	struct alarm_eval *e;
+	struct metrics_cache *c;
+	unsigned long cum;
+	int i;
+
+	if (t->metrics == NULL) {
+		t->metrics = NEW(struct metrics_cache, 1);
+		if (t->metrics == NULL) {
+			logit("Out of memory while rendering metrics");
+			exit(1);
+		}
+	}
+	c = t->metrics;
+	c->len = 0;
+
+	escape_label(name, sizeof(name), t->name);
+	escape_label(srcip, sizeof(srcip), t->srcip);
+	escape_label(descr, sizeof(descr), t->description);
+	snprintf(labels, sizeof(labels),
+	    "target=\"%s\",srcip=\"%s\",description=\"%s\"",
+	    name, srcip, descr);
+
+	c->off[MF_SENT] = c->len;
+	cache_printf(c, "%s{%s} %i\n", families[MF_SENT].name, labels,
+	    t->last_sent);
+
+	c->off[MF_RECEIVED] = c->len;
+	cache_printf(c, "%s{%s} %lu\n", families[MF_RECEIVED].name, labels,
+	    t->received_total);
+
+	c->off[MF_LOSS] = c->len;
+	if (AVG_LOSS_KNOWN(t)) {
+		cache_printf(c, "%s{%s} %.4f\n", families[MF_LOSS].name,
+		    labels, AVG_LOSS(t) / 100);
+	}
+
+	c->off[MF_DELAY] = c->len;
+	if (AVG_DELAY_KNOWN(t)) {
+		cache_printf(c, "%s{%s} %.6f\n", families[MF_DELAY].name,
+		    labels, target_delay(t) / 1000);
+	}
+
+	c->off[MF_DELAY_RAW] = c->len;
+	if (config->calibrate && AVG_DELAY_KNOWN(t)) {
+		cache_printf(c, "%s{%s} %.6f\n", families[MF_DELAY_RAW].name,
+		    labels, AVG_DELAY(t) / 1000);
+	}
+
+	c->off[MF_RTT] = c->len;
+	cum = 0;
+	for (i = 0; i < RTT_BUCKETS; i++) {
+		cum += t->rtt_hist[i];
+		cache_printf(c, "%s_bucket{%s,le=\"%g\"} %lu\n",
+		    families[MF_RTT].name, labels, rtt_bounds[i] / 1000, cum);
+	}
+	cum += t->rtt_hist[RTT_BUCKETS];
+	cache_printf(c, "%s_bucket{%s,le=\"+Inf\"} %lu\n",
+	    families[MF_RTT].name, labels, cum);
+	cache_printf(c, "%s_sum{%s} %.6f\n", families[MF_RTT].name, labels,
+	    t->rtt_sum / 1000);
+	cache_printf(c, "%s_count{%s} %lu\n", families[MF_RTT].name, labels,
+	    cum);
+
+	c->off[MF_ALARM] = c->len;
+	for (i = 0; t->alarms_on && i < t->config->nalarm_tab; i++) {
+		e = &t->config->alarm_tab[i];
+		if (!(t->alarms_on & e->bit)) {
+			continue;
+		}
+		escape_label(name, sizeof(name), e->alarm->name);
+		cache_printf(c, "%s{%s,alarm=\"%s\",type=\"%s\"} 1\n",
+		    families[MF_ALARM].name, labels, name,
+		    alarm_type_name(e->type));
+	}
+
+	c->off[MF_INTERVAL] = c->len;
+	cache_printf(c, "%s{%s} %.3f\n", families[MF_INTERVAL].name, labels,
+	    (t->cur_interval ? t->cur_interval : t->config->interval) /
+	    1000.0);
+
+	c->off[MF_TRAIN_LOSS] = c->len;
+	if (t->trains) {
+		cache_printf(c, "%s{%s} %.4f\n", families[MF_TRAIN_LOSS].name,
+		    labels, t->train_loss);
+	}
+
+	c->off[MF_TRAIN_DISPERSION] = c->len;
+	if (t->trains) {
+		cache_printf(c, "%s{%s} %.6f\n",
+		    families[MF_TRAIN_DISPERSION].name, labels,
+		    t->train_dispersion / 1000);
+	}
+
+	c->off[MF_TRAIN_REORDERED] = c->len;
+	if (t->trains) {
+		cache_printf(c, "%s{%s} %i\n",
+		    families[MF_TRAIN_REORDERED].name, labels,
+		    t->train_reorder);
+	}
+
+	c->off[MF_DUPLICATES] = c->len;
+	cache_printf(c, "%s{%s} %lu\n", families[MF_DUPLICATES].name, labels,
+	    t->duplicates);
+
+	c->off[MF_REORDERED] = c->len;
+	cache_printf(c, "%s{%s} %lu\n", families[MF_REORDERED].name, labels,
+	    t->reordered);
+
+	c->off[MF_ICMP_ERRORS] = c->len;
+	cache_printf(c, "%s{%s,type=\"unreachable\"} %lu\n",
+	    families[MF_ICMP_ERRORS].name, labels, t->unreachable);
+	cache_printf(c, "%s{%s,type=\"time_exceeded\"} %lu\n",
+	    families[MF_ICMP_ERRORS].name, labels, t->time_exceeded);
+
+	c->off[NR_FAMILIES] = c->len;
+	t->dirty = 0;
+}
+
+static void
+buf_printf(struct metrics_buf *b, const char *format, ...)
+{
+	char line[256];
+	va_list args;
+	int n;
+
+	va_start(args, format);
+	n = vsnprintf(line, sizeof(line), format, args);
+	va_end(args);
+	if (n > 0) {
+		buf_append(b, line, (size_t)n < sizeof(line) ?
+		    (size_t)n : sizeof(line) - 1);
+	}
+}
+
+static void
+render_self_hist(struct metrics_buf *b, const char *name,
+    const char *labels, const struct self_hist *h)
+{
+	const char *sep = *labels ? "," : "";
+	unsigned long cum;
+	int i;
+
+	cum = 0;
+	for (i = 0; i < SELF_BUCKETS; i++) {
+		cum += h->buckets[i];
+		buf_printf(b, "%s_bucket{%s%sle=\"%g\"} %lu\n", name, labels,
+		    sep, self_bounds[i] / 1000, cum);
+	}
+	cum += h->buckets[SELF_BUCKETS];
+	buf_printf(b, "%s_bucket{%s%sle=\"+Inf\"} %lu\n", name, labels, sep,
+	    cum);
+	if (*labels) {
+		buf_printf(b, "%s_sum{%s} %.6f\n%s_count{%s} %lu\n",
+		    name, labels, h->sum / 1000, name, labels, cum);
+	} else {
+		buf_printf(b, "%s_sum %.6f\n%s_count %lu\n",
+		    name, h->sum / 1000, name, cum);
+	}
+}
+
+/* apinger's own timing changes all the time, it is rendered per scrape */
+static void
+render_self(struct metrics_buf *b)
+{
+	char labels[64];
+	int i;
+
+	buf_printf(b, "# HELP apinger_self_duration_seconds "
+	    "Time apinger spent on its own work, per phase.\n"
+	    "# TYPE apinger_self_duration_seconds histogram\n");
+	for (i = 0; i < NR_SELF_PHASES; i++) {
+		if (i == SELF_LATENESS) {
+			continue;
+		}
+		snprintf(labels, sizeof(labels), "phase=\"%s\"",
+		    self_phase_name(i));
+		render_self_hist(b, "apinger_self_duration_seconds", labels,
+		    &self_hist[i]);
+	}
+
+	buf_printf(b, "# HELP apinger_self_probe_lateness_seconds "
+	    "Delay between the scheduled and actual send time of probes.\n"
+	    "# TYPE apinger_self_probe_lateness_seconds histogram\n");
+	render_self_hist(b, "apinger_self_probe_lateness_seconds", "",
+	    &self_hist[SELF_LATENESS]);
+
+	buf_printf(b, "# HELP apinger_self_wakeups_total "
+	    "Main loop wakeups from poll().\n"
+	    "# TYPE apinger_self_wakeups_total counter\n"
+	    "apinger_self_wakeups_total %lu\n", self_wakeups);
+}
+
+static struct metrics_buf *
+metrics_build(void)
+{
+	struct metrics_cache *c;
+	struct metrics_buf *b;
+	struct target *t;
+	char hdr[256];
+	int f, n;
+
+	for (t = targets; t; t = t->next) {
+		if (t->dirty || t->metrics == NULL) {
+			render_target(t);
+			stale = 1;
+		}
+	}
+
+	if (!stale && current) {
+		/* clients still sending the old snapshot keep their copy */
+		if (current->refs > 1) {
+			b = NEW(struct metrics_buf, 1);
+			if (b == NULL) {
+				logit("Out of memory while rendering metrics");
+				exit(1);
+			}
+			b->refs = 1;
+			buf_append(b, current->data, current->base);
+			b->base = current->base;
+			buf_release(current);
+			current = b;
+		}
+		current->len = current->base;
+		render_self(current);
+		return (current);
+	}
+
+	/* clients still sending the old snapshot keep their reference */
+	if (current && current->refs > 1) {
+		buf_release(current);
+		current = NULL;
+	}
+	if (current == NULL) {
+		current = NEW(struct metrics_buf, 1);
+		if (current == NULL) {
+			logit("Out of memory while rendering metrics");
+			exit(1);
+		}
+		current->refs = 1;
+	}
+	current->len = 0;
+
+	for (f = 0; f < NR_FAMILIES; f++) {
+		n = snprintf(hdr, sizeof(hdr), "# HELP %s %s\n# TYPE %s %s\n",
+		    families[f].name, families[f].help, families[f].name,
+		    families[f].type);
+		buf_append(current, hdr, n);
+		for (t = targets; t; t = t->next) {
+			c = t->metrics;
+			buf_append(current, c->buf + c->off[f],
+			    c->off[f + 1] - c->off[f]);
+		}
+	}
+
+	current->base = current->len;
+	render_self(current);
+	stale = 0;
+
+	return (current);
+}
+
+void
+metrics_observe(struct target *t, double delay)
+{
+	int i;
+
+	for (i = 0; i < RTT_BUCKETS && delay > rtt_bounds[i]; i++)
+		/* empty */;
+	t->rtt_hist[i]++;
+	t->rtt_sum += delay;
+	t->received_total++;
+	t->dirty = 1;
+}
+
+void
+metrics_forget(struct target *t)
+{
+	if (t->metrics) {
+		free(t->metrics->buf);
+		free(t->metrics);
+		t->metrics = NULL;
+	}
+	stale = 1;
+}
+
+static void
+client_close(struct metrics_client *cl)
+{
+	close(cl->fd);
+	cl->fd = -1;
+	buf_release(cl->out);
+	cl->out = NULL;
+}
+
+static void
+client_respond(struct metrics_client *cl)
+{
+	const char *status;
+
+	if (strncmp(cl->req, "GET ", 4) == 0) {
+		status = "200 OK";
+		cl->out = metrics_build();
+		cl->out->refs++;
+	} else {
+		status = "405 Method Not Allowed";
+	}
+
+	cl->hdrlen = snprintf(cl->hdr, sizeof(cl->hdr),
+	    "HTTP/1.0 %s\r\n"
+	    "Content-Type: text/plain; version=0.0.4\r\n"
+	    "Content-Length: %lu\r\n"
+	    "Connection: close\r\n\r\n",
+	    status, (unsigned long)(cl->out ? cl->out->len : 0));
+	cl->off = 0;
+}
+
+static void
+client_read(struct metrics_client *cl)
+{
+	ssize_t n;
+
+	n = recv(cl->fd, cl->req + cl->reqlen,
+	    sizeof(cl->req) - cl->reqlen - 1, MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR)) {
+		return;
+	}
+	if (n <= 0) {
+		client_close(cl);
+		return;
+	}
+	cl->reqlen += n;
+	cl->req[cl->reqlen] = '\0';
+
+	if (strstr(cl->req, "\r\n\r\n") || strstr(cl->req, "\n\n") ||
+	    cl->reqlen == sizeof(cl->req) - 1) {
+		client_respond(cl);
+	}
+}
+
+static void
+client_write(struct metrics_client *cl)
+{
+	struct iovec iov[2];
+	struct msghdr msg;
+	size_t total;
+	ssize_t n;
+	int niov = 0;
+
+	total = cl->hdrlen + (cl->out ? cl->out->len : 0);
+
+	if (cl->off < cl->hdrlen) {
+		iov[niov].iov_base = cl->hdr + cl->off;
+		iov[niov++].iov_len = cl->hdrlen - cl->off;
+	}
+	if (cl->out && cl->out->len) {
+		size_t boff = cl->off > cl->hdrlen ? cl->off - cl->hdrlen : 0;
+
+		iov[niov].iov_base = cl->out->data + boff;
+		iov[niov++].iov_len = cl->out->len - boff;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = niov;
+
+	n = sendmsg(cl->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EINTR) {
+			client_close(cl);
+		}
+		return;
+	}
+	cl->off += n;
+	if (cl->off >= total) {
+		client_close(cl);
+	}
+}
+
+static void
+metrics_accept(void)
+{
+	struct metrics_client *cl;
+	int fd;
+
+	while ((fd = accept(listen_fd, NULL, NULL)) >= 0) {
+		if (nclients >= METRICS_MAX_CLIENTS) {
+			debug("Too many metrics clients, dropping connection");
+			close(fd);
+			continue;
+		}
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+#ifdef SO_NOSIGPIPE
+		{
+			int one = 1;
+
+			setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &one,
+			    sizeof(one));
+		}
+#endif
+		cl = &clients[nclients++];
+		memset(cl, 0, sizeof(*cl));
+		cl->fd = fd;
+		cl->started = time(NULL);
+	}
+}
+
+int
+metrics_pollfds(struct pollfd *pfd, int max)
+{
+	time_t now;
+	int i, n = 0;
+
+	if (listen_fd < 0 || max < 1) {
+		return (0);
+	}
+
+	pfd[n].fd = listen_fd;
+	pfd[n].events = POLLIN;
+	pfd[n++].revents = 0;
+
+	now = time(NULL);
+
+	for (i = 0; i < nclients && n < max; i++) {
+		if (clients[i].fd >= 0 &&
+		    now - clients[i].started > METRICS_TIMEOUT) {
+			debug("Metrics client timed out");
+			client_close(&clients[i]);
+		}
+		pfd[n].fd = clients[i].fd;
+		pfd[n].events = clients[i].hdrlen ? POLLOUT : POLLIN;
+		pfd[n++].revents = 0;
+	}
+
+	return (n);
+}
+
+void
+metrics_process(struct pollfd *pfd, int n)
+{
+	struct metrics_client *cl;
+	int i, j;
+
+	if (listen_fd < 0 || n < 1) {
+		return;
+	}
+
+	/* pfd[1..] were filled from clients[] in the same order */
+	for (i = 1; i < n && i - 1 < nclients; i++) {
+		cl = &clients[i - 1];
+		if (cl->fd < 0 || pfd[i].fd != cl->fd || !pfd[i].revents) {
+			continue;
+		}
+		if (pfd[i].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+			client_close(cl);
+		} else if (cl->hdrlen == 0) {
+			client_read(cl);
+		}
+		if (cl->fd >= 0 && cl->hdrlen) {
+			client_write(cl);
+		}
+	}
+
+	for (i = j = 0; i < nclients; i++) {
+		if (clients[i].fd >= 0) {
+			clients[j++] = clients[i];
+		}
+	}
+	nclients = j;
+
+	if (pfd[0].revents & POLLIN) {
+		metrics_accept();
+	}
+}
+
+static int
+metrics_listen(const char *spec)
+{
+	struct addrinfo hints, *res;
+	struct sockaddr_un sun;
+	char host[128], *port;
+	mode_t mask;
+	int fd, one = 1;
+	int r;
+
+	if (spec[0] == '/') {
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		if (strlen(spec) >= sizeof(sun.sun_path)) {
+			logit("Metrics socket path too long: %s", spec);
+			return (-1);
+		}
+		strcpy(sun.sun_path, spec);
+		unlink(spec);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0) {
+			myperror("socket()");
+			return (-1);
+		}
+		/* scrapers connect as the daemon's user or group */
+		mask = umask(0117);
+		r = bind(fd, (struct sockaddr *)&sun, sizeof(sun));
+		umask(mask);
+		if (r < 0) {
+			logit("Could not bind metrics socket %s", spec);
+			myperror("bind()");
+			close(fd);
+			return (-1);
+		}
+	} else {
+		snprintf(host, sizeof(host), "%s", spec);
+		port = strrchr(host, ':');
+		if (port == NULL) {
+			logit("Bad metrics listen address: %s", spec);
+			return (-1);
+		}
+		*port++ = '\0';
+		if (host[0] == '[' && port - host > 2 && port[-2] == ']') {
+			port[-2] = '\0';
+			memmove(host, host + 1, strlen(host));
+		}
+
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		hints.ai_flags = AI_NUMERICHOST | AI_PASSIVE;
+		if (getaddrinfo(host[0] ? host : NULL, port, &hints, &res)) {
+			logit("Bad metrics listen address: %s", spec);
+			return (-1);
+		}
+		fd = socket(res->ai_family, SOCK_STREAM, 0);
+		if (fd < 0) {
+			myperror("socket()");
+			freeaddrinfo(res);
+			return (-1);
+		}
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, res->ai_addr, res->ai_addrlen) < 0) {
+			logit("Could not bind metrics socket %s", spec);
+			myperror("bind()");
+			freeaddrinfo(res);
+			close(fd);
+			return (-1);
+		}
+		freeaddrinfo(res);
+	}
+
+	if (listen(fd, METRICS_MAX_CLIENTS) < 0) {
+		myperror("listen()");
+		close(fd);
+		return (-1);
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return (fd);
+}
+
+void
+metrics_init(void)
+{
+	const char *spec = config->metrics_listen;
+
+	if (listen_spec && spec && strcmp(listen_spec, spec) == 0) {
+		return;
+	}
+
+	metrics_close();
+
+	if (spec == NULL) {
+		return;
+	}
+
+	listen_fd = metrics_listen(spec);
+	if (listen_fd >= 0) {
+		listen_spec = strdup(spec);
+		debug("Serving metrics on %s", spec);
+	}
+}
+
+void
+metrics_close(void)
+{
+	struct target *t;
+	int i;
+
+	for (i = 0; i < nclients; i++) {
+		client_close(&clients[i]);
+	}
+	nclients = 0;
+
+	if (listen_fd >= 0) {
+		close(listen_fd);
+		listen_fd = -1;
+	}
+	if (listen_spec) {
+		if (listen_spec[0] == '/') {
+			unlink(listen_spec);
+		}
+		free(listen_spec);
+		listen_spec = NULL;
+	}
+
+	buf_release(current);
+	current = NULL;
+
+	for (t = targets; t; t = t->next) {
+		metrics_forget(t);
+	}
+}
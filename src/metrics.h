@@ -0,0 +1,33 @@
+/*
+ *  Alarm Pinger (c) 2002 Jacek Konieczny <jajcus@jajcus.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+struct pollfd;
+struct target;
+
+void	metrics_init(void);
+void	metrics_close(void);
+int	metrics_pollfds(struct pollfd *, int);
+void	metrics_process(struct pollfd *, int);
+void	metrics_observe(struct target *, double);
+void	metrics_forget(struct target *);
+
+#endif	/* METRICS_H */
@@ -116,15 +116,16 @@ rrd_write(const char *format, ...)
 void
 rrd_create(void)
 {
-	const char *filename;
+	char filename[MACRO_BUF_SIZE];
 	struct target *t;
 	int ret;
 
 	for (t = targets; t != NULL; t = t->next) {
-		if (t->config->rrd_filename == NULL) {
+		if (t->config->rrd_filename_tmpl == NULL) {
 			continue;
 		}
-		filename = subst_macros(t->config->rrd_filename, t, NULL, 0);
+		expand_macros(t->config->rrd_filename_tmpl, filename,
+		    sizeof(filename), t, NULL, 0);
 #if defined(HAVE_ACCESS) && defined(F_OK)
 		if (access(filename, F_OK) == 0) {
 			continue;
@@ -163,7 +164,7 @@ rrd_create(void)
 void
 rrd_update(void)
 {
-	const char *filename;
+	char filename[MACRO_BUF_SIZE];
 	struct target *t;
 	int ret;
 
@@ -177,7 +178,7 @@ rrd_update(void)
 	}
 
 	for (t = targets; t != NULL; t = t->next) {
-		if (t->config->rrd_filename == NULL) {
+		if (t->config->rrd_filename_tmpl == NULL) {
 			continue;
 		}
 
@@ -187,7 +188,8 @@ rrd_update(void)
 			}
 		}
 
-		filename = subst_macros(t->config->rrd_filename, t, NULL, 0);
+		expand_macros(t->config->rrd_filename_tmpl, filename,
+		    sizeof(filename), t, NULL, 0);
 		ret = rrd_write("update %s -t loss:delay %ld",
 		    filename, time(NULL));
 		if (ret > 0){
@@ -202,8 +204,7 @@ rrd_update(void)
 		}
 		if (ret > 0) {
 			if (t->upsent > t->config->avg_delay_samples) {
-				rrd_write(":%f", (t->delay_sum /
-				    t->config->avg_delay_samples) / 1000);
+				rrd_write(":%f", target_delay(t) / 1000);
 			} else {
 				ret = rrd_write(":U");
 			}
@@ -223,7 +224,9 @@ int
 rrd_print_cgi(const char *graph_dir, const char *graph_location)
 {
 	char *base_filename, *buf, *p1;
+	char filename[MACRO_BUF_SIZE];
 	const char *rrd_filename, *p;
+	struct target_iter it;
 	struct target_cfg *tc;
 	struct target t;
 	int num_esc;
@@ -237,79 +240,85 @@ rrd_print_cgi(const char *graph_dir, const char *graph_location)
 	memset(&t, 0, sizeof(t));
 
 	for (tc = config->targets; tc; tc = tc->next) {
-		if (tc->rrd_filename == NULL) {
+		if (tc->rrd_filename_tmpl == NULL) {
 			continue;
 		}
 
 		t.description = tc->description;
-		t.name = tc->name;
 
-		rrd_filename = subst_macros(tc->rrd_filename, &t, NULL, 0);
-		buf = strdup(rrd_filename);
+		target_iter_init(&it, tc);
+		while (target_iter_next(&it)) {
+			snprintf(t.name, sizeof(t.name), "%s", it.name);
 
-		base_filename = strrchr(buf, '/');
-		if (base_filename != NULL) {
-			*base_filename++ = 0;
-		} else {
-			base_filename = buf;
-		}
-
-		p1 = strrchr(base_filename, '.');
-		if (p1 != NULL) {
-			*p1 = 0;
-		}
+			expand_macros(tc->rrd_filename_tmpl, filename,
+			    sizeof(filename), &t, NULL, 0);
+			rrd_filename = filename;
+			buf = strdup(rrd_filename);
 
-		num_esc = 0;
+			base_filename = strrchr(buf, '/');
+			if (base_filename != NULL) {
+				*base_filename++ = 0;
+			} else {
+				base_filename = buf;
+			}
 
-		for (p = rrd_filename; *p; p++) {
-			if (*p == ':' || *p == '\\') {
-				num_esc++;
+			p1 = strrchr(base_filename, '.');
+			if (p1 != NULL) {
+				*p1 = 0;
 			}
-		}
 
-		if (num_esc > 0) {
-			ebuf = NEW(char, strlen(rrd_filename) + num_esc + 1);
-			p1 = ebuf;
+			num_esc = 0;
 
 			for (p = rrd_filename; *p; p++) {
 				if (*p == ':' || *p == '\\') {
-					*p1++ = '\\';
+					num_esc++;
 				}
-				*p1++ = *p;
 			}
-			*p1++ = 0;
-			rrd_filename = ebuf;
-		} else {
-			ebuf = NULL;
-		}
 
-		printf("<P><RRD::GRAPH %s/%s-delay.png\n", graph_dir, base_filename);
-		printf("--imginfo '<IMG SRC=\"%s/%%s\" WIDTH=\"%%lu\" HEIGHT=\"%%lu\">'\n", graph_location);
-		printf("-a PNG -h 200 -w 800 --lazy -v 'Packet RTT (s)'\n");
-		printf("-t 'Packet delay summary for %s (%s)'\n", tc->name, tc->description);
-		printf("-s -1d -l 0\n");
-		printf("DEF:delay=%s:delay:AVERAGE\n", rrd_filename);
-		printf("AREA:delay#00a000:\n");
-		printf("LINE1:delay#004000:\n");
-		printf("GPRINT:delay:MIN:\"Minimum\\: %%7.3lf%%ss\"\n");
-		printf("GPRINT:delay:AVERAGE:\"Average\\: %%7.3lf%%ss\"\n");
-		printf("GPRINT:delay:MAX:\"Maximum\\: %%7.3lf%%ss\\j\"\n");
-		printf("></P>");
-
-		printf("<P><RRD::GRAPH %s/%s-loss.png\n", graph_dir, base_filename);
-		printf("--imginfo '<IMG SRC=\"%s/%%s\" WIDTH=\"%%lu\" HEIGHT=\"%%lu\">'\n", graph_location);
-		printf("-a PNG -h 200 -w 800 --lazy -v 'Packet loss (%%)'\n");
-		printf("-t 'Packet loss summary for %s (%s)'\n", tc->name, tc->description);
-		printf("-s -1d -l 0 -u 100\n");
-		printf("DEF:loss=%s:loss:AVERAGE\n", rrd_filename);
-		printf("AREA:loss#f00000:\n");
-		printf("LINE1:loss#700000:\n");
-		printf("GPRINT:loss:MIN:\"Minimum\\: %%5.1lf%%%%\"\n");
-		printf("GPRINT:loss:AVERAGE:\"Average\\: %%5.1lf%%%%\"\n");
-		printf("GPRINT:loss:MAX:\"Maximum\\: %%5.1lf%%%%\\j\"\n");
-		printf("></P>\n");
-		free(buf);
-		free(ebuf);
+			if (num_esc > 0) {
+				ebuf = NEW(char, strlen(rrd_filename) + num_esc + 1);
+				p1 = ebuf;
+
+				for (p = rrd_filename; *p; p++) {
+					if (*p == ':' || *p == '\\') {
+						*p1++ = '\\';
+					}
+					*p1++ = *p;
+				}
+				*p1++ = 0;
+				rrd_filename = ebuf;
+			} else {
+				ebuf = NULL;
+			}
+
+			printf("<P><RRD::GRAPH %s/%s-delay.png\n", graph_dir, base_filename);
+			printf("--imginfo '<IMG SRC=\"%s/%%s\" WIDTH=\"%%lu\" HEIGHT=\"%%lu\">'\n", graph_location);
+			printf("-a PNG -h 200 -w 800 --lazy -v 'Packet RTT (s)'\n");
+			printf("-t 'Packet delay summary for %s (%s)'\n", t.name, t.description);
+			printf("-s -1d -l 0\n");
+			printf("DEF:delay=%s:delay:AVERAGE\n", rrd_filename);
+			printf("AREA:delay#00a000:\n");
+			printf("LINE1:delay#004000:\n");
+			printf("GPRINT:delay:MIN:\"Minimum\\: %%7.3lf%%ss\"\n");
+			printf("GPRINT:delay:AVERAGE:\"Average\\: %%7.3lf%%ss\"\n");
+			printf("GPRINT:delay:MAX:\"Maximum\\: %%7.3lf%%ss\\j\"\n");
+			printf("></P>");
+
+			printf("<P><RRD::GRAPH %s/%s-loss.png\n", graph_dir, base_filename);
+			printf("--imginfo '<IMG SRC=\"%s/%%s\" WIDTH=\"%%lu\" HEIGHT=\"%%lu\">'\n", graph_location);
+			printf("-a PNG -h 200 -w 800 --lazy -v 'Packet loss (%%)'\n");
+			printf("-t 'Packet loss summary for %s (%s)'\n", t.name, t.description);
+			printf("-s -1d -l 0 -u 100\n");
+			printf("DEF:loss=%s:loss:AVERAGE\n", rrd_filename);
+			printf("AREA:loss#f00000:\n");
+			printf("LINE1:loss#700000:\n");
+			printf("GPRINT:loss:MIN:\"Minimum\\: %%5.1lf%%%%\"\n");
+			printf("GPRINT:loss:AVERAGE:\"Average\\: %%5.1lf%%%%\"\n");
+			printf("GPRINT:loss:MAX:\"Maximum\\: %%5.1lf%%%%\\j\"\n");
+			printf("></P>\n");
+			free(buf);
+			free(ebuf);
+		}
 	}
 
 	printf("<P><b>apinger</b> by Jacek Konieczny</P>\n");
@@ -0,0 +1,153 @@
+/*
+ *  Alarm Pinger (c) 2002 Jacek Konieczny <jajcus@jajcus.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ */
+
+/*
+ * Timing of apinger's own work, to tell a slow daemon from a slow
+ * network. Durations go into fixed histograms which are written to the
+ * "self_file" of the status section and exported as metrics.
+ */
+
+#include "config.h"
+#include "apinger.h"
+
+#include <stdio.h>
+
+#include "backend.h"
+#include "debug.h"
+#include "selfstat.h"
+
+struct self_hist self_hist[NR_SELF_PHASES];
+unsigned long self_wakeups;
+
+/* upper bounds of the histogram buckets in milliseconds */
+const double self_bounds[SELF_BUCKETS] = {
+	0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 50, 100,
+	250, 500, 1000, 2500, 5000
+};
+
+static const char *phase_names[NR_SELF_PHASES] = {
+	"loop",
+	"make_reports",
+	"write_status",
+	"rrd_update",
+	"reload",
+	"probe_lateness",
+};
+
+const char *
+self_phase_name(enum self_phase phase)
+{
+	return (phase_names[phase]);
+}
+
+/* the daemon's own work takes real time, even when the network is simulated */
+nstime_t
+self_clock(void)
+{
+	return (raw_backend.gettime());
+}
+
+void
+self_observe_ms(enum self_phase phase, double ms)
+{
+	struct self_hist *h = &self_hist[phase];
+	int i;
+
+	for (i = 0; i < SELF_BUCKETS && ms > self_bounds[i]; i++)
+		/* empty */;
+	h->buckets[i]++;
+	h->count++;
+	h->sum += ms;
+	if (ms > h->max) {
+		h->max = ms;
+	}
+}
+
+void
+self_observe(enum self_phase phase, nstime_t start)
+{
+	self_observe_ms(phase, NS2MSEC(self_clock() - start));
+}
+
+/* upper bound of the bucket holding the q-quantile */
+static double
+self_quantile(const struct self_hist *h, double q)
+{
+	unsigned long cum, rank;
+	int i;
+
+	if (h->count == 0) {
+		return (0);
+	}
+
+	rank = q * h->count;
+	if (rank < 1) {
+		rank = 1;
+	}
+	cum = 0;
+	for (i = 0; i < SELF_BUCKETS; i++) {
+		cum += h->buckets[i];
+		if (cum >= rank) {
+			return (self_bounds[i] < h->max ? self_bounds[i] : h->max);
+		}
+	}
+
+	return (h->max);
+}
+
+/* one line per phase: name|count|average|p50|p99|max, then the wakeups */
+void
+write_self_status(void)
+{
+	static unsigned long last_wakeups;
+	static nstime_t last_time;
+	struct self_hist *h;
+	nstime_t now;
+	double rate, secs;
+	FILE *f;
+	int i;
+
+	f = fopen(config->status_self_file, "w");
+	if (f == NULL) {
+		logit("Couldn't open self status file");
+		myperror(config->status_self_file);
+		return;
+	}
+
+	for (i = 0; i < NR_SELF_PHASES; i++) {
+		h = &self_hist[i];
+		fprintf(f, "%s|%lu|%.3fms|%.3fms|%.3fms|%.3fms\n",
+		    phase_names[i], h->count, h->count ? h->sum / h->count : 0,
+		    self_quantile(h, 0.5), self_quantile(h, 0.99), h->max);
+	}
+
+	now = self_clock();
+	rate = 0;
+	if (last_time != 0) {
+		secs = (double)(now - last_time) / NSEC_PER_SEC;
+		if (secs > 0) {
+			rate = (self_wakeups - last_wakeups) / secs;
+		}
+	}
+	last_time = now;
+	last_wakeups = self_wakeups;
+	fprintf(f, "wakeups|%lu|%.1f/s\n", self_wakeups, rate);
+
+	fclose(f);
+}
@@ -0,0 +1,53 @@
+/*
+ *  Alarm Pinger (c) 2002 Jacek Konieczny <jajcus@jajcus.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ */
+
+#ifndef SELFSTAT_H
+#define SELFSTAT_H
+
+
+enum self_phase {
+	SELF_LOOP,		/* main loop iteration, without poll() */
+	SELF_REPORTS,		/* make_reports() */
+	SELF_STATUS,		/* write_status() */
+	SELF_RRD,		/* rrd_update() */
+	SELF_RELOAD,		/* main loop blocked by a config reload */
+	SELF_LATENESS,		/* probe sent after its scheduled time */
+	NR_SELF_PHASES
+};
+
+#define SELF_BUCKETS	18
+
+struct self_hist {
+	unsigned long count;
+	double sum;		/* milliseconds */
+	double max;
+	unsigned long buckets[SELF_BUCKETS + 1];
+};
+
+extern struct self_hist self_hist[NR_SELF_PHASES];
+extern const double self_bounds[SELF_BUCKETS];
+extern unsigned long self_wakeups;
+
+nstime_t	self_clock(void);
+void		self_observe(enum self_phase, nstime_t);
+void		self_observe_ms(enum self_phase, double);
+const char	*self_phase_name(enum self_phase);
+void		write_self_status(void);
+
+#endif	/* SELFSTAT_H */
@@ -0,0 +1,258 @@
+/*
+ *  Alarm Pinger (c) 2002 Jacek Konieczny <jajcus@jajcus.net>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as published
+ *  by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307
+ *  USA
+ *
+ */
+
+/*
+ * Simulated network: probes never leave the process, replies are queued
+ * with a per-target delay and handed to analyze_reply() when the virtual
+ * clock reaches them. The clock jumps straight to the next event instead
+ * of sleeping, so the main loop runs as fast as the CPU allows.
+ */
+
+#include "config.h"
+#include "apinger.h"
+
+#include <stdio.h>
+#ifdef HAVE_STDLIB_H
+# include <stdlib.h>
+#endif
+#ifdef HAVE_STRING_H
+# include <string.h>
+#endif
+#ifdef HAVE_SIGNAL_H
+# include <signal.h>
+#endif
+#ifdef HAVE_SYS_POLL_H
+# include <sys/poll.h>
+#endif
+#ifdef HAVE_SYS_TIME_H
+# include <sys/time.h>
+#endif
+
+#include "backend.h"
+#include "debug.h"
+
+struct sim_event {
+	nstime_t at;		/* arrival time of the reply */
+	int icmp_seq;
+	struct trace_info ti;
+};
+
+static struct sim_event *sim_heap;
+static size_t sim_heap_len;
+static size_t sim_heap_size;
+
+static nstime_t sim_now;
+static nstime_t sim_start;
+static nstime_t sim_end;
+static nstime_t real_start;
+
+static unsigned long sim_sent;
+static unsigned long sim_lost;
+static unsigned long sim_delivered;
+
+static void
+sim_heap_push(const struct sim_event *ev)
+{
+	size_t i, parent;
+
+	if (sim_heap_len == sim_heap_size) {
+		sim_heap_size = sim_heap_size ? sim_heap_size * 2 : 1024;
+		sim_heap = realloc(sim_heap, sim_heap_size * sizeof(*sim_heap));
+		if (sim_heap == NULL) {
+			logit("Out of memory for simulated replies");
+			exit(1);
+		}
+	}
+
+	for (i = sim_heap_len++; i > 0; i = parent) {
+		parent = (i - 1) / 2;
+		if (ev->at >= sim_heap[parent].at) {
+			break;
+		}
+		sim_heap[i] = sim_heap[parent];
+	}
+	sim_heap[i] = *ev;
+}
+
+static void
+sim_heap_pop(struct sim_event *ev)
+{
+	struct sim_event *last;
+	size_t i, child;
+
+	*ev = sim_heap[0];
+	last = &sim_heap[--sim_heap_len];
+
+	for (i = 0; (child = 2 * i + 1) < sim_heap_len; i = child) {
+		if (child + 1 < sim_heap_len &&
+		    sim_heap[child + 1].at < sim_heap[child].at) {
+			child++;
+		}
+		if (sim_heap[child].at >= last->at) {
+			break;
+		}
+		sim_heap[i] = sim_heap[child];
+	}
+	sim_heap[i] = *last;
+}
+
+static int
+sim_open(struct target *t)
+{
+	t->socket = 0;
+	return (0);
+}
+
+static void
+sim_send(struct target *t, int seq)
+{
+	struct sim_event ev;
+	unsigned int h;
+	nstime_t rtt;
+
+	sim_sent++;
+	if (config->sim_loss > 0 && random() % 100 < config->sim_loss) {
+		sim_lost++;
+		return;
+	}
+
+	/* each target has its own base RTT, 50% to 150% of the configured one */
+	h = hash_string(HASH_INIT, t->name);
+	rtt = MSEC2NS(config->sim_delay) / 100 * (50 + h % 101);
+	if (t->config->calibration) {
+		/* loopback, only our own latency */
+		rtt = 0;
+	}
+	if (config->sim_jitter > 0) {
+		rtt += random() % MSEC2NS(config->sim_jitter);
+	}
+	/* held back long enough to be overtaken by the next probe */
+	if (config->sim_reorder > 0 && random() % 100 < config->sim_reorder) {
+		rtt += MSEC2NS(t->cur_interval + config->sim_delay);
+	}
+
+	make_trace_info(&ev.ti, t, seq);
+	ev.icmp_seq = seq & 0xffff;
+	ev.at = sim_now + rtt;
+	sim_heap_push(&ev);
+}
+
+static void
+sim_recv(struct target *t, nstime_t time_recv, nstime_t timedelta)
+{
+	(void)t;
+	(void)time_recv;
+	(void)timedelta;
+}
+
+/*
+ * Real descriptors (control, metrics, reload) are checked without
+ * waiting; when none is ready the virtual clock advances to the next
+ * probe or reply, whichever comes first, and due replies are delivered.
+ */
+static int
+sim_poll(struct pollfd *pfd, int npfd, int timeout)
+{
+	struct sim_event ev;
+	nstime_t until;
+	int ret;
+
+	ret = poll(pfd, npfd, 0);
+	if (ret != 0) {
+		return (ret);
+	}
+
+	if (next_probe > sim_now) {
+		until = next_probe;
+	} else {
+		until = sim_now + MSEC2NS(timeout);
+	}
+	/*
+	 * Like poll() the simulation wakes up with millisecond granularity,
+	 * replies arriving within the same millisecond are handled together.
+	 * Their receive timestamps stay exact.
+	 */
+	if (sim_heap_len > 0 && sim_heap[0].at < until) {
+		until = (sim_heap[0].at + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC *
+		    NSEC_PER_MSEC;
+	}
+	if (until > sim_now) {
+		sim_now = until;
+	} else {
+		/* events fire once strictly past, so time must always move */
+		sim_now++;
+	}
+
+	while (sim_heap_len > 0 && sim_heap[0].at <= sim_now) {
+		sim_heap_pop(&ev);
+		sim_delivered++;
+		analyze_reply(ev.at, ev.icmp_seq, &ev.ti, 0);
+	}
+
+	if (sim_end != 0 && sim_now >= sim_end) {
+		interrupted_by = SIGTERM;
+	}
+
+	return (0);
+}
+
+static nstime_t
+sim_gettime(void)
+{
+	return (sim_now);
+}
+
+static void
+sim_close(void)
+{
+	logit("Simulation: %lu probes sent, %lu lost, %lu replies delivered, "
+	    "%.3fs virtual time in %.3fs",
+	    sim_sent, sim_lost, sim_delivered,
+	    (double)(sim_now - sim_start) / NSEC_PER_SEC,
+	    (double)(raw_backend.gettime() - real_start) / NSEC_PER_SEC);
+
+	free(sim_heap);
+	sim_heap = NULL;
+	sim_heap_len = sim_heap_size = 0;
+}
+
+const struct packet_backend sim_backend = {
+	.name = "sim",
+	.open = sim_open,
+	.send = sim_send,
+	.recv = sim_recv,
+	.poll = sim_poll,
+	.gettime = sim_gettime,
+	.close = sim_close,
+};
+
+void
+sim_init(void)
+{
+	/* same random sequence on every run */
+	srandom(1);
+
+	real_start = raw_backend.gettime();
+	sim_now = sim_start = real_start;
+	sim_end = 0;
+	if (config->sim_duration > 0) {
+		sim_end = sim_start + MSEC2NS(config->sim_duration);
+	}
+	backend = &sim_backend;
+}